@@ -24,8 +24,6 @@
 int main ( int argc, char *argv[] )
 {
 
-	char dummy_block[BLOCK_SIZE];
-
 	if(argc != 2){
 		printf("ERROR: Incorrect number of arguments:\n");
 		printf("Syntax: ./create_disk <num_blocks>\n");
@@ -38,19 +36,18 @@ int main ( int argc, char *argv[] )
 
 	if(fd < 0){
 		fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE disk.dat \n");
+		return -1;
 	}
 
-	memset(dummy_block, '0', BLOCK_SIZE);
-
-	int i;
-	int total_write, write_result;
-	for(i = 0; i < num_blocks; i++){
-		total_write = 0;
-		do{
-			write_result = write(fd, dummy_block+total_write, BLOCK_SIZE-total_write);
-			total_write = total_write + write_result;
-		}while(total_write < BLOCK_SIZE && write_result >= 0);
+	// The image is created sparse: blocks take host space only
+	// once they are written
+	if(ftruncate(fd, (off_t)num_blocks*BLOCK_SIZE) < 0){
+		fprintf(stderr, "ERROR: UNABLE TO RESIZE DISK FILE disk.dat \n");
+		close(fd);
+		return -1;
 	}
 
+	close(fd);
+
 	return 0;
 }
@@ -0,0 +1,189 @@
+
+/*
+ *
+ * Operating System Design / Diseño de Sistemas Operativos
+ * (c) ARCOS.INF.UC3M.ES
+ *
+ * @file 	aio.c
+ * @brief 	Implementation of the asynchronous file API, on top of readFileAt and writeFileAt.
+ * @date	Last revision 01/04/2020
+ *
+ */
+
+#include "filesystem/filesystem.h" // Headers for the core functionality
+#include "filesystem/auxiliary.h"  // Headers for auxiliary functions
+#include <pthread.h>
+#include <stddef.h>
+
+#define AIO_WORKERS 4   // Threads serving the submitted requests
+
+#define AIO_READ  0
+#define AIO_WRITE 1
+
+/* Submitted request */
+typedef struct {
+  int op;                       /* AIO_READ or AIO_WRITE */
+  int fd;                       /* File descriptor */
+  void *buffer;                 /* Bytes read or written */
+  int numBytes;                 /* Size of the buffer */
+  long offset;                  /* Position in the file */
+  fs_aio_callback_t callback;   /* Called at completion, NULL to queue it */
+  void *user_data;              /* Given back at completion */
+} aio_request_t;
+
+/* Submission queue: requests waiting for a worker */
+static aio_request_t submitted[FS_AIO_DEPTH];
+static int submit_head = 0, submit_count = 0;
+
+/* Completion queue: finished requests waiting for aio_pollFile */
+static fs_aio_event_t completed[FS_AIO_DEPTH];
+static int complete_head = 0, complete_count = 0;
+
+// Requests submitted and not yet given back, either by
+// a callback or by aio_pollFile. Never above FS_AIO_DEPTH
+static int pending = 0;
+
+// Requests submitted and not yet served by a worker
+static int running = 0;
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submit_cond = PTHREAD_COND_INITIALIZER;   // A request was submitted
+static pthread_cond_t complete_cond = PTHREAD_COND_INITIALIZER; // A request was completed
+static int workers = 0;                                         // Workers started
+
+
+/*
+ * @brief 	Serves submitted requests forever. Reads run in parallel with each other
+ * @return 	Never returns.
+ */
+static void *aio_worker(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&aio_lock);
+	for (;;){
+		while (submit_count == 0){
+			pthread_cond_wait(&submit_cond, &aio_lock);
+		}
+		aio_request_t req = submitted[submit_head];
+		submit_head = (submit_head + 1) % FS_AIO_DEPTH;
+		submit_count--;
+		pthread_mutex_unlock(&aio_lock);
+
+		int result;
+		if (req.op == AIO_READ){
+			result = readFileAt(req.fd, req.buffer, req.numBytes, req.offset);
+		} else {
+			result = writeFileAt(req.fd, req.buffer, req.numBytes, req.offset);
+		}
+
+		pthread_mutex_lock(&aio_lock);
+		running--;
+		if (req.callback != NULL){
+			// The request is given back before its callback runs, so the
+			// callback can poll, submit or unmount without waiting for itself
+			pending--;
+			pthread_cond_broadcast(&complete_cond);
+			pthread_mutex_unlock(&aio_lock);
+			req.callback(req.user_data, result);
+			pthread_mutex_lock(&aio_lock);
+			continue;
+		}
+
+		int tail = (complete_head + complete_count) % FS_AIO_DEPTH;
+		completed[tail].user_data = req.user_data;
+		completed[tail].result = result;
+		complete_count++;
+		pthread_cond_broadcast(&complete_cond);
+	}
+	return NULL;
+}
+
+/*
+ * @brief 	Queues a request, starting the workers the first time
+ * @return 	0 if success, -1 if the queue is full or in case of error.
+ */
+static int aio_submit(aio_request_t *req) {
+	if (req->buffer == NULL || req->numBytes < 0 || req->offset < 0){
+		return -1;
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	while (workers < AIO_WORKERS){
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, aio_worker, NULL) != 0){ break; }
+		pthread_detach(thread);
+		workers++;
+	}
+	if (workers == 0 || pending == FS_AIO_DEPTH){
+		pthread_mutex_unlock(&aio_lock);
+		return -1;
+	}
+
+	submitted[(submit_head + submit_count) % FS_AIO_DEPTH] = *req;
+	submit_count++;
+	running++;
+	pending++;
+	pthread_cond_signal(&submit_cond);
+	pthread_mutex_unlock(&aio_lock);
+	return 0;
+}
+
+/*
+ * @brief	Starts reading from a file at a given position, without waiting for it.
+ * @return	0 if the request was queued, -1 otherwise.
+ */
+int aio_readFile(int fileDescriptor, void *buffer, int numBytes, long offset,
+                 fs_aio_callback_t callback, void *user_data) {
+	aio_request_t req = { AIO_READ, fileDescriptor, buffer, numBytes, offset, callback, user_data };
+	return aio_submit(&req);
+}
+
+/*
+ * @brief	Starts writing into a file at a given position, without waiting for it.
+ * @return	0 if the request was queued, -1 otherwise.
+ */
+int aio_writeFile(int fileDescriptor, void *buffer, int numBytes, long offset,
+                  fs_aio_callback_t callback, void *user_data) {
+	aio_request_t req = { AIO_WRITE, fileDescriptor, buffer, numBytes, offset, callback, user_data };
+	return aio_submit(&req);
+}
+
+/*
+ * @brief	Takes up to 'max' completions from the completion queue.
+ * @return	Number of completions stored, -1 in case of error.
+ */
+int aio_pollFile(fs_aio_event_t *events, int max, int wait) {
+	if (events == NULL || max < 0){
+		return -1;
+	}
+
+	pthread_mutex_lock(&aio_lock);
+	// Waiting only makes sense while some request can still complete
+	while (wait && max > 0 && complete_count == 0 && pending > 0){
+		pthread_cond_wait(&complete_cond, &aio_lock);
+	}
+
+	int count = 0;
+	while (count < max && complete_count > 0){
+		events[count++] = completed[complete_head];
+		complete_head = (complete_head + 1) % FS_AIO_DEPTH;
+		complete_count--;
+		pending--;
+	}
+	pthread_mutex_unlock(&aio_lock);
+
+	return count;
+}
+
+/*
+ * @brief	Waits until no asynchronous request is still running
+ * @return	0 if success, -1 otherwise.
+ */
+int aio_drain(void) {
+	pthread_mutex_lock(&aio_lock);
+	while (running > 0){
+		pthread_cond_wait(&complete_cond, &aio_lock);
+	}
+	pthread_mutex_unlock(&aio_lock);
+
+	return 0;
+}
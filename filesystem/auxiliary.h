@@ -10,6 +10,30 @@
  *
  */
 
+/*
+ * @brief 	Writes an empty file system of 'deviceSize' bytes
+ * @return 	0 if success, -1 otherwise.
+ */
+int mkfs_init ( long deviceSize );
+
+/*
+ * @brief 	Reads the metadata from disk and resets the state kept only in memory
+ * @return 	0 if success, -1 otherwise.
+ */
+int mount_init ( void );
+
+/*
+ * @brief 	Releases the mappings and writes everything still in memory to disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int mount_flush ( void );
+
+/*
+ * @brief 	Waits until no asynchronous request is still running
+ * @return 	0 if success, -1 otherwise.
+ */
+int aio_drain ( void );
+
 /*
  * @brief 	Allocates a inode in memory
  * @return 	Position if success, -1 otherwise.
@@ -17,10 +41,11 @@
 int ialloc(void);
 
 /*
- * @brief 	Allocates a block in disk
- * @return 	Position if success, -1 otherwise.
+ * @brief 	Allocates between 'min_len' and 'max_len' contiguous blocks, as close
+ *          after 'goal' as possible. The length of the run is stored in 'len' (if not NULL).
+ * @return 	First block of the run if success, -1 otherwise.
  */
-int balloc(void);
+int balloc_range(int goal, int min_len, int max_len, int *len);
 
 /*
  * @brief 	Free a indoe in memory
@@ -34,6 +59,12 @@ int ifree(int inode);
  */
 int bfree ( int block_id );
 
+/*
+ * @brief 	Free 'count' consecutive blocks in memory
+ * @return 	0 if success, -1 otherwise.
+ */
+int bfree_run ( int block_id, int count );
+
 /*
  * @brief 	Search for a inode with name 'fname'
  * @return 	inode id if success, -1 otherwise.
@@ -41,10 +72,336 @@ int bfree ( int block_id );
 int name_i ( char *fname );
 
 /*
- * @brief 	Gives the datablock where the file with offset is
- * @return 	block id if success, -1 otherwise.
+ * @brief 	Copies a path to 'canonical' without empty components (repeated,
+ *          leading or trailing '/'). 'canonical' holds MAX_PATH_LENGHT characters.
+ * @return 	Length of the canonical path if success, -1 if it does not fit.
+ */
+int path_canonical ( char *path, char *canonical );
+
+/*
+ * @brief 	Forgets the cached lookup of a path
+ * @return 	0 if success, -1 otherwise.
+ */
+int pcache_forget ( char *path );
+
+/*
+ * @brief 	Forgets the cached lookups that found an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int pcache_forget_inode ( int inode_id );
+
+/*
+ * @brief 	Search for the inode of the first 'len' characters of a path
+ * @return 	inode id if success, -1 otherwise.
+ */
+int namei_len ( char *path, int len );
+
+/*
+ * @brief 	Search for the directory holding the last component of a path,
+ *          which is copied to 'name'
+ * @return 	inode id of the directory if success, -1 otherwise.
+ */
+int namei_parent ( char *path, char *name );
+
+/*
+ * @brief 	Search for the entry 'name' of a directory
+ * @return 	inode id if success, -1 otherwise.
+ */
+int dir_lookup ( int dir, char *name );
+
+/*
+ * @brief 	Adds the entries of a directory block to the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_load ( int dir, int bucket );
+
+/*
+ * @brief 	Adds the entries of every directory to the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_load_all ( void );
+
+/*
+ * @brief 	Adds an entry for an inode to a directory block
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_add ( int dir, int inode_id );
+
+/*
+ * @brief 	Removes the entry of an inode from a directory block
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_remove ( int dir, int inode_id );
+
+/*
+ * @brief 	Creates an inode of type 'type' for a path, with no data
+ * @return 	inode id if success, -1 if the path already exists, -2 in case of error.
+ */
+int i_create ( char *path, int type );
+
+/*
+ * @brief 	Removes an inode from its directory and frees it with its blocks
+ * @return 	0 if success, -1 otherwise.
+ */
+int i_remove ( int inode_id );
+
+/*
+ * @brief 	Adds the name of an inode to the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_insert ( int inode_id );
+
+/*
+ * @brief 	Removes the name of an inode from the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_remove ( int inode_id );
+
+/*
+ * @brief 	Resets the name index. Directory blocks are loaded into it as lookups reach them
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_reset ( void );
+
+/*
+ * @brief 	Follows a chain of links up to the file it reaches
+ * @return 	inode id of the file if success, -1 if a link is broken or the chain loops.
+ */
+int i_follow ( int inode_id );
+
+/*
+ * @brief 	Gives the file a path reaches once its links are followed
+ * @return 	inode id of the file if success, -1 if the path does not exist,
+ *          -2 if it is a directory or a link that reaches no file.
+ */
+int name_file ( char *path );
+
+/*
+ * @brief 	Gives the file reached by an open descriptor, checking that it was not removed since
+ * @return 	inode id of the file if success, -1 otherwise.
+ */
+int fd_inode ( int fd );
+
+/*
+ * @brief 	Takes a free entry of the open file table for an inode. Needs data_lock held exclusively
+ * @return 	file descriptor if success, -1 if the table is full.
+ */
+int fd_alloc ( int inode_id );
+
+/*
+ * @brief 	Frees an entry of the open file table. Needs data_lock held exclusively
+ * @return 	0 if success, -1 otherwise.
+ */
+int fd_release ( int fd );
+
+/*
+ * @brief 	Checks the blocks of an inode against their stored CRC
+ * @return 	0 if success, -1 if the file is corrupted, -2 in case of error.
+ */
+int crc_check ( int inode_id );
+
+/*
+ * @brief 	Stores the CRC of every block of an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int crc_include ( int inode_id );
+
+/*
+ * @brief 	Reads bytes of an inode starting at 'position' into the segments of 'iov',
+ *          reading each block once whatever the number of segments it spans
+ * @return 	Number of bytes read, -1 in case of error.
+ */
+int file_readv ( int inode_id, fs_iovec_t *iov, int iovcnt, int position );
+
+/*
+ * @brief 	Writes the segments of 'iov' into an inode starting at 'position', growing
+ *          the file if they go past its end. Each block is read and written once
+ *          whatever the number of segments it spans
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int file_writev ( int inode_id, fs_iovec_t *iov, int iovcnt, int position );
+
+/*
+ * @brief 	Makes an inode at least 'end' bytes long. Appending writes
+ *          go on from the new end unless some of them are in flight
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_grow ( int inode_id, int end );
+
+/*
+ * @brief 	Reads into the segments of 'iov' through a descriptor, at its offset. Readers
+ *          sharing a descriptor claim their ranges with an atomic update of the offset
+ * @return 	Number of bytes read, -1 in case of error.
+ */
+int fd_readv ( int fd, fs_iovec_t *iov, int iovcnt );
+
+/*
+ * @brief 	Writes the segments of 'iov' through a descriptor, at its offset or,
+ *          if it was opened with FS_O_APPEND, at the end of the file
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int fd_writev ( int fd, fs_iovec_t *iov, int iovcnt );
+
+/*
+ * @brief 	Appends the segments of 'iov' through a descriptor. The range is reserved
+ *          with an atomic update of the end of the file, so appenders never wait for
+ *          each other to know where to write, and the size grows in reservation order
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int fd_append ( int fd, fs_iovec_t *iov, int iovcnt );
+
+/*
+ * @brief 	Waits until the appended bytes before 'start' are in the size,
+ *          then adds the range up to 'end'
+ * @return 	0 if success, -1 if the file was removed.
+ */
+int append_publish ( int inode_id, int generation, int start, int end );
+
+/*
+ * @brief 	Allocates the holes of a range of an inode, growing the file
+ *          unless FS_FALLOC_KEEP_SIZE is set
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_fallocate ( int inode_id, int offset, int len, int flags );
+
+/*
+ * @brief 	Pins the slices of 'len' bytes of an inode starting at 'position' in the
+ *          block cache, one view per block. Holes view a block of zeros
+ * @return 	Number of views stored, -1 in case of error.
+ */
+int file_view ( int inode_id, int position, int len, fs_view_t *views, int max );
+
+/*
+ * @brief 	Gets a data block into the block cache and pins it
+ * @return 	Frame holding the block, NULL if every frame is pinned or in case of error.
+ */
+char *bcache_pin ( int block_id );
+
+/*
+ * @brief 	Unpins the cache frame a view points into. Views of the zero block are ignored
+ * @return 	0 if success, -1 otherwise.
+ */
+int bcache_unpin ( const void *view );
+
+/*
+ * @brief 	Drops a data block from the block cache after it changed or was freed.
+ *          A pinned frame keeps the old contents for its views
+ * @return 	0 if success, -1 otherwise.
+ */
+int bcache_forget ( int block_id );
+
+/*
+ * @brief 	Maps 'len' bytes of an inode starting at 'position' into anonymous
+ *          memory, filled at once so later accesses never call the file system
+ * @return 	Address of the mapping, NULL in case of error.
+ */
+void *map_create ( int inode_id, int position, int len, int prot );
+
+/*
+ * @brief 	Gives the mapping starting at 'addr'
+ * @return 	map id if success, -1 otherwise.
+ */
+int map_find ( void *addr );
+
+/*
+ * @brief 	Writes back the blocks of a mapping that changed since the last sync.
+ *          Bytes past the end of the file are not written
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_writeback ( int map );
+
+/*
+ * @brief 	Writes back all the mappings of an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_sync ( int inode_id );
+
+/*
+ * @brief 	Writes back a mapping and frees it
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_release ( int map );
+
+/*
+ * @brief 	Creates a file at 'path' with the contents of an inode, sharing its blocks
+ * @return 	inode id of the new file if success, -1 if it exists, -2 in case of error.
+ */
+int file_clone ( int src, char *path );
+
+/*
+ * @brief 	Releases blocks 'first' to 'last' of an inode, freeing each run of
+ *          consecutive disk blocks at once, and the delayed data among them
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_release ( int inode_id, int first, int last );
+
+/*
+ * @brief 	Zeroes the bytes of an inode from 'start' to 'end', both in the same block
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_zero ( int inode_id, int start, int end );
+
+/*
+ * @brief 	Zeroes 'len' bytes of an inode from 'offset', releasing
+ *          the blocks fully inside the range
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_punch ( int inode_id, int offset, int len );
+
+/*
+ * @brief 	Sets the size of an inode. Growing leaves a hole; shrinking releases
+ *          the blocks past the new end and zeroes the rest of the last one
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_truncate ( int inode_id, int len );
+
+/*
+ * @brief 	Gives the datablock where the file with offset is, without allocating it
+ * @return 	block id if success, -1 if there is none (a hole).
+ */
+int b_lookup ( int inode_id, int offset );
+
+/*
+ * @brief 	Reads block 'block' of an inode. Unwritten blocks read as zeros
+ *          without touching the disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int b_read ( int inode_id, int block, char *buffer );
+
+/*
+ * @brief 	Gives block 'block' of an inode a disk block of its own, instead of one
+ *          shared with clones. The new block is unwritten: the caller writes it
+ * @return 	id of the new block if success, -1 otherwise.
+ */
+int b_unshare ( int inode_id, int block );
+
+/*
+ * @brief 	Allocates disk blocks for 'count' unallocated blocks of an inode starting
+ *          at block 'first', contiguously after the previous block of the file
+ * @return 	0 if success, -1 otherwise.
+ */
+int b_alloc ( int inode_id, int first, int count );
+
+/*
+ * @brief 	Gives the delayed buffer holding block 'block' of an inode. If there is none
+ *          and 'create' is TRUE, a zeroed buffer is set up and a disk block reserved for it.
+ * @return 	Buffer data if success, NULL otherwise.
+ */
+char *dbuf_get ( int inode_id, int block, int create );
+
+/*
+ * @brief 	Allocates disk blocks for the delayed buffers of an inode (-1 for all inodes)
+ *          and writes them to disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int dbuf_flush ( int inode_id );
+
+/*
+ * @brief 	Discards the delayed buffers of blocks 'first' to 'last' of an inode
+ *          without writing them
+ * @return 	0 if success, -1 otherwise.
  */
-int b_map ( int inode_id, int offset );
+int dbuf_discard ( int inode_id, int first, int last );
 
 /*
  * @brief 	Read metadata from disk to memory
@@ -12,6 +12,7 @@
  */
 
 
+#define _GNU_SOURCE                     // fallocate() and FALLOC_FL_* flags
 #include "filesystem/blocks_cache.h"
 
 
@@ -85,3 +86,27 @@ int bwrite(char *deviceName, int blockNumber, char*buffer) {
 
 	return 0;
 }
+
+/*
+ * Tells the device that the contents of numBlocks consecutive blocks
+ * are no longer needed.
+ * Returns 0 or -1 in case of error.
+ */
+int bdiscard(char *deviceName, int blockNumber, int numBlocks) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	int fd = open(deviceName, O_WRONLY);
+
+	if(fd < 0){
+		return -1;
+	}
+
+	int err = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                    (off_t)BLOCK_SIZE*blockNumber, (off_t)BLOCK_SIZE*numBlocks);
+
+	close(fd);
+
+	return err == 0 ? 0 : -1;
+#else
+	return 0;
+#endif
+}
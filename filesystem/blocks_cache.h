@@ -42,4 +42,12 @@ int bread(char *deviceName, int blockNumber, char *buffer);
  * Returns 0 if correct or -1 in case of error.
  */
 int bwrite(char *deviceName, int blockNumber, char*buffer);
+
+/*
+ * Tells the device that the contents of numBlocks consecutive blocks are
+ * no longer needed, punching a hole in the image where the host supports
+ * it. The blocks read as zeros afterwards.
+ * Returns 0 if correct or -1 in case of error.
+ */
+int bdiscard(char *deviceName, int blockNumber, int numBlocks);
 #endif
@@ -14,8 +14,11 @@
 #include "filesystem/auxiliary.h"  // Headers for auxiliary functions
 #include "filesystem/metadata.h"   // Type and structure declaration of the file system
 #include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 /*
  * @brief 	Generates the proper file system structure in a storage device, as designed by the student.
+ *          Fails while a file system is mounted.
  * @return 	0 if success, -1 otherwise.
  */
 int mkFS(long deviceSize) {
@@ -25,43 +28,12 @@ int mkFS(long deviceSize) {
 		return -1;
 	}
 
-	// Set default settings
-	superblock.magic_num = 383464;
-	superblock.num_inodes = 0;
-	superblock.device_size = deviceSize;
-	superblock.block_num = deviceSize/BLOCK_SIZE;
-	
-	
-	// Set all inode_map bits to 0
-	for (int i = 0; i < MAX_FILE_NUM; i++){
-		bitmap_setbit(superblock.inode_map, i, 0); //free
-	}
-
-	// Set all block_map bits to 0
-	for (int i = 0; i < MAX_BLOCK_NUM; i++) {
-		bitmap_setbit(superblock.block_map, i, 0); //free
-	}
-	
-	// Initialize all inodes to 0
-	for (int i=0; i < MAX_FILE_NUM; i++) {
-        memset(&(inodes[i]), '\0', sizeof(inode_t) );
-    }
-	
-	// Reset all data blocks
-	char empty_block[BLOCK_SIZE];
-	memset(empty_block, '\0', BLOCK_SIZE);
+	// The caches and mappings of a mounted file system would outlive the format
+	pthread_rwlock_wrlock(&data_lock);
+	int err = isMounted ? -1 : mkfs_init(deviceSize);
+	pthread_rwlock_unlock(&data_lock);
 
-	for (int i = 0; i < superblock.block_num; i++) {
-		if (bwrite(DEVICE_IMAGE, firstDataBlock + i, empty_block) == -1) {
-			return -1;
-		}
-	}
-
-	if (meta_writeToDisk() == -1){
-		return -1;
-	}
-
-	return 0;
+	return err;
 }
 
 /*
@@ -69,16 +41,16 @@ int mkFS(long deviceSize) {
  * @return 	0 if success, -1 otherwise.
  */
 int mountFS(void) {
+	int err = -1;
 
-	if (!isMounted){
-		if (meta_readFromDisk() == -1){
-			return -1;
-		}
+	pthread_rwlock_wrlock(&data_lock);
+	if (!isMounted && mount_init() == 0){
 		isMounted = TRUE;
-	} else {
-		return -1;
+		err = 0;
 	}
-	return 0;	
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
 }
 
 /*
@@ -86,18 +58,88 @@ int mountFS(void) {
  * @return 	0 if success, -1 otherwise.
  */
 int unmountFS(void) {
-	if (isMounted){
-		if (meta_writeToDisk() == -1){
-			return -1;
-		}
+	int err = -1;
+	if (!isMounted){ return -1; }
+
+	// Asynchronous requests still running would write after the final flush
+	if (aio_drain() == -1){ return -1; }
+
+	pthread_rwlock_wrlock(&data_lock);
+	if (isMounted && mount_flush() == 0){
 		isMounted = FALSE;
-	} else {
+		err = 0;
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief	Gives the size and free space of the file system.
+ * @return	0 if success, -1 otherwise.
+ */
+int statFS(fs_stat_t *stat) {
+	if (!isMounted || stat == NULL){
 		return -1;
 	}
 
+	pthread_rwlock_rdlock(&data_lock);
+	stat->block_size   = BLOCK_SIZE;
+	stat->total_blocks = data_block_num();
+	stat->free_blocks  = block_map_x.nfree - block_map_x.nreserved;
+	stat->total_inodes = MAX_FILE_NUM;
+	stat->free_inodes  = inode_map_x.nfree;
+	pthread_rwlock_unlock(&data_lock);
 	return 0;
 }
 
+/*
+ * @brief	Lists up to 'max' files, links and directories, starting at 'cursor'.
+ *          The root directory is not listed.
+ * @return	Number of entries stored (0 when there are no more), -1 in case of error.
+ */
+int listFiles(int *cursor, fs_entry_t *entries, int max) {
+	if (!isMounted || cursor == NULL || entries == NULL || max < 0){
+		return -1;
+	}
+
+	int count = 0, inode_id = *cursor;
+	if (inode_id < 0){ return -1; }
+
+	// The parent of an inode is known once its directory is in the name
+	// index. Loading it changes the index, so this excludes everyone else
+	pthread_rwlock_wrlock(&data_lock);
+	if (dir_load_all() == -1){
+		pthread_rwlock_unlock(&data_lock);
+		return -1;
+	}
+
+	// Everything else comes from the inode table in memory
+	for ( ; inode_id < MAX_FILE_NUM && count < max; inode_id++){
+		if (inode_id == ROOT_DIR || bitmap_getbit(superblock.inode_map, inode_id) == 0){ continue; }
+
+		fs_entry_t *entry = &entries[count++];
+		entry->inode_id = inode_id;
+		entry->type = inodes[inode_id].type;
+		strcpy(entry->name, inode_name(inode_id));
+		entry->parent = parent_x[inode_id];
+		entry->size = 0;
+		entry->blocks = 0;
+		if (inodes[inode_id].type != LINK){
+			entry->size = inodes[inode_id].inode.size;
+			for (int i = 0; i < 5; i++){
+				if (inodes[inode_id].inode.direct_block[i] != -1 || dbuf_get(inode_id, i, FALSE) != NULL){
+					entry->blocks++;
+				}
+			}
+		}
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	*cursor = inode_id;
+	return count;
+}
+
 /*
  * @brief	Creates a new file, provided it it doesn't exist in the file system.
  * @return	0 if success, -1 if the file already exists, -2 in case of error.
@@ -109,45 +151,21 @@ int createFile(char *fileName) {
 		return -2;
 	}
 	
-	int b_id, inode_id;
-
-	// Check if filename alredy exists
-	if (name_i(fileName) != -1 ){
-		return -1;
-	}
-
-	// Alloc the inode and if  there isn't 
-	// enought space return -2
-	inode_id = ialloc();
-    if (inode_id == -1){
-        return -2;
+	int inode_id = -2;
+
+	// Changes to the namespace exclude everyone else
+	pthread_rwlock_wrlock(&data_lock);
+	// Fail fast if there is no inode left. Otherwise create the inode in
+	// its directory, data blocks are allocated when its contents reach the disk
+	if (inode_map_x.nfree > 0){
+		inode_id = i_create(fileName, INODE);
 	}
-    // Alloc the block and if  there isn't 
-	// enought space return -2
-	b_id = balloc();
-    if (b_id == -1) {
-		ifree(inode_id); // If there is no block space free the inode also
-        return -2;
-    }
-	// Check that the name size is legal
-	if (strlen(fileName) > MAX_NAME_LENGHT) {return -2;}
-	
-	// Set default settings for the new inode
-	inodes[inode_id].type = INODE;
-	strcpy(inodes[inode_id].inode.name, fileName);
-	inodes[inode_id].inode.direct_block[0] = b_id;
-	for (int i = 1; i < sizeof(inodes[inode_id].inode.direct_block)/4; i++){
-		inodes[inode_id].inode.direct_block[i] = -1;
-		inodes[inode_id].inode.crc[i] = 0;
+	if (inode_id >= 0){
+		superblock.num_inodes++;
 	}
-	inodes[inode_id].inode.size = 0;
-
-	// Set the offset and state in file desctiptor
-	inodes_x[inode_id].offset    = 0;
-    inodes_x[inode_id].state     = CLOSE;
+	pthread_rwlock_unlock(&data_lock);
 
-	superblock.num_inodes++;
-    return 0;
+	return (inode_id < 0) ? inode_id : 0;
 }
 
 /*
@@ -160,28 +178,22 @@ int removeFile(char *fileName) {
 		return -2;
 	}
 	
-	int inode_id;
+	int err = -1;
 
+	pthread_rwlock_wrlock(&data_lock);
 	// Check if filename exists
-	inode_id = name_i(fileName);
-	if (inode_id == -1){
-		return -1;
-	}
-
-	// If it's a soft link return error
-	if (inodes[inode_id].type == LINK ) {return -2;}
-
-	// Free the direct block
-	for (int i=0; i<5; i++){
-		int block = inodes[inode_id].inode.direct_block[i];
-		if (block != -1){
-			if (bfree(block) == -1) { return -2;}
+	int inode_id = name_i(fileName);
+	if (inode_id != -1){
+		// If it's a soft link or a directory return error
+		err = -2;
+		if (inodes[inode_id].type == INODE && i_remove(inode_id) != -1){
+			superblock.num_inodes--;
+			err = 0;
 		}
 	}
-	
-	if (ifree(inode_id) == -1 ){ return -2;} 
-	superblock.num_inodes--;
-	return 0;
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
 }
 
 /*
@@ -189,29 +201,35 @@ int removeFile(char *fileName) {
  * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
  */
 int openFile(char *fileName) {
+	return openFileFlags(fileName, 0);
+}
+
+/*
+ * @brief	Opens an existing file with the FS_O_* flags given.
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
+ */
+int openFileFlags(char *fileName, int flags) {
 	// If filesystem isn't mounted return error
 	if (!isMounted){ return -2;}
-	int inode_id;
-	inode_id = name_i(fileName);
-	// Check if the fileName exist
-	if (inode_id == -1){ return -1; }
-	
-	// Check if it's currently opened
-	if (inodes_x[inode_id].state == OPEN) {
-		return -2;
-	}
-
-	if (inodes[inode_id].type == LINK){
-		int err = openFile(inodes[inode_id].soft_link.source);
-		if (err==-1) {return -2;}
+	if (flags & ~FS_O_APPEND){ return -2; }
+
+	// Looking up the path fills the name caches
+	pthread_rwlock_wrlock(&data_lock);
+	// Follow the links once, the descriptor keeps the file they reach
+	int fd = name_file(fileName);
+	if (fd >= 0){
+		// Take a new descriptor with its own offset. A file
+		// can be open through any number of them
+		fd = fd_alloc(fd);
+		if (fd == -1){
+			fd = -2;
+		} else {
+			files_x[fd].flags = flags;
+		}
 	}
+	pthread_rwlock_unlock(&data_lock);
 
-	// Open the file, set offset to 0 and returns its
-	// file descriptor id
-	inodes_x[inode_id].state = OPEN;
-	inodes_x[inode_id].offset = 0;
-	inodes_x[inode_id].integrity = FALSE;
-	return inode_id;
+	return fd;
 }
 
 /*
@@ -222,21 +240,24 @@ int closeFile(int fileDescriptor){
 	
 	// If filesystem isn't mounted return error
 	if (!isMounted){ return -1;	}
-
-	if (inodes_x[fileDescriptor].integrity == TRUE) {return -1;}
-
-	// Check if it's currently closed
-	if (inodes_x[fileDescriptor].state == CLOSE){ return -1;}
-
-	if (inodes[fileDescriptor].type == LINK){
-		int source_fd = name_i(inodes[fileDescriptor].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		closeFile(source_fd);
+	if (fileDescriptor < 0 || fileDescriptor >= MAX_OPEN_FILES){ return -1; }
+
+	int err = -1;
+
+	pthread_rwlock_wrlock(&data_lock);
+	// Check if it's currently closed, or opened with integrity
+	if (files_x[fileDescriptor].state == OPEN && !(files_x[fileDescriptor].flags & FD_INTEGRITY)){
+		// Write back what was changed through its mappings
+		int inode_id = fd_inode(fileDescriptor);
+		err = (inode_id != -1) ? map_sync(inode_id) : 0;
+		//Close the file
+		if (err == 0){
+			err = fd_release(fileDescriptor);
+		}
 	}
-	
-	//Close the file and return 0
-	inodes_x[fileDescriptor].state = CLOSE;
-	return 0;
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
 }
 
 /*
@@ -245,61 +266,11 @@ int closeFile(int fileDescriptor){
  */
 int readFile(int fileDescriptor, void *buffer, int numBytes) {
 	if (!isMounted) {return -1; }
-	if (inodes_x[fileDescriptor].state == CLOSE) {return -1;}
-	// Check that the file is legal and exists
-	if (fileDescriptor > MAX_FILE_NUM || fileDescriptor < 0) { return -1;}
-	if (bitmap_getbit(superblock.inode_map, fileDescriptor) == 0){ return -1; }
 	// Check that numBytes has the right size
 	if (numBytes < 0) { return -1; }
-	if (numBytes == 0) { return 0;}
-	
 
-	if (inodes[fileDescriptor].type == LINK){
-		int source_fd = name_i(inodes[fileDescriptor].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		return readFile(source_fd, buffer, numBytes);
-	}
-	
-	int size, position = inodes_x[fileDescriptor].offset;
-	int blocks, readed = 0, toread = 0;
-	char b[BLOCK_SIZE];
-	memset(b, '\0', BLOCK_SIZE);
-	
-	size = inodes[fileDescriptor].inode.size;
-	if (size == position){ return 0;}
-	
-	// If the bytes to read are greater than the available bytes
-	//  then read only the bytes available
-	if (numBytes > size - position){
-		numBytes = size - position;
-	}
-
-	
-	blocks = ((position+numBytes)/BLOCK_SIZE) + 1; // Number of blocks where we are going to write
-	for (int i = 0; i < blocks; i++){
-		int block_id = b_map(fileDescriptor, position); // Get the number of block to read
-		if (block_id == -1){ return -1; }
-		// If i it's not the last (first and middle) and there is more than one block
-		if ((i!=blocks-1 && (blocks>1))){
-			toread = BLOCK_SIZE - position%BLOCK_SIZE; // Get the size to read
-		}
-		// If it's the last block or the first of a single-block read
-		else{
-			toread = numBytes - readed; // Get the size to write
-		}
-		// Read the block, and append the bytes 'toread'
-		// to the buffer
-		if (bread(DEVICE_IMAGE, firstDataBlock + block_id, b) == -1){ return -1; };
-		memmove(buffer+readed, &b[position%BLOCK_SIZE], toread);
-		
-		readed += toread;
-		position += toread;
-	}	
-	// Update offset and size
-	inodes_x[fileDescriptor].offset += numBytes;
-
-
-	return numBytes;
+	fs_iovec_t iov = { buffer, numBytes };
+	return fd_readv(fileDescriptor, &iov, 1);
 }
 
 /*
@@ -308,284 +279,633 @@ int readFile(int fileDescriptor, void *buffer, int numBytes) {
  */
 int writeFile(int fileDescriptor, void *buffer, int numBytes){
 	if (!isMounted) {return -1;}
-	// Check that the file is legal and exists
-	if (fileDescriptor > MAX_FILE_NUM || fileDescriptor < 0) {return -1;}
-	if (bitmap_getbit(superblock.inode_map, fileDescriptor) == 0){return -1;}
 	// Check that numBytes has the right size
 	if (numBytes < 0) {return -1;}
-	if (numBytes == 0 || inodes_x[fileDescriptor].offset == MAX_FILE_SIZE) {return 0;}
-	if (inodes_x[fileDescriptor].state == CLOSE) { return -1;}
-	
-	if (inodes[fileDescriptor].type == LINK){
-		int source_fd = name_i(inodes[fileDescriptor].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		return writeFile(source_fd, buffer, numBytes);
-	}
 
-	int position = inodes_x[fileDescriptor].offset;
-	int blocks, writed = 0, towrite = 0;
-	char b[BLOCK_SIZE];
-	memset(b, '\0', BLOCK_SIZE);
+	fs_iovec_t iov = { buffer, numBytes };
+	return fd_writev(fileDescriptor, &iov, 1);
+}
 
-	
-	if (numBytes > (MAX_FILE_SIZE - position)){
-		numBytes = MAX_FILE_SIZE - position;
+/*
+ * @brief	Reads a number of bytes from a file at a given position, without using
+ *          or changing the offset of the descriptor.
+ * @return	Number of bytes properly read, -1 in case of error.
+ */
+int readFileAt(int fileDescriptor, void *buffer, int numBytes, long offset) {
+	if (!isMounted) {return -1; }
+	if (numBytes < 0 || offset < 0 || offset > MAX_FILE_SIZE) { return -1; }
+
+	// Readers of file data run in parallel
+	pthread_rwlock_rdlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	fs_iovec_t iov = { buffer, numBytes };
+	int readed = -1;
+	if (inode_id != -1){
+		readed = file_readv(inode_id, &iov, 1, offset);
 	}
-	blocks = ((position+numBytes)/BLOCK_SIZE) + 1; // Number of blocks where we are going to write
-	for (int i = 0; i < blocks; i++){
-		int block_id = b_map(fileDescriptor, position); // Get the number of block to read
-		if (block_id == -1){ return -1; }
-		// If i it's not the last (first and middle) and there is more than one block
-		if ((i!=blocks-1 && (blocks>1))){
-			towrite = BLOCK_SIZE - position%BLOCK_SIZE; // Get the size to read
-		}
-		// If it's the last block or the first of a single-block read
-		else{
-			towrite = numBytes - writed; // Get the size to write
-		}
+	pthread_rwlock_unlock(&data_lock);
 
-		if (bread(DEVICE_IMAGE, firstDataBlock + block_id, b) == -1){return -1;};
-		memmove(&b[position%BLOCK_SIZE], buffer+writed, towrite);
-		if (bwrite(DEVICE_IMAGE, firstDataBlock + block_id, b) == -1){return -1;};
-		
-		writed += towrite;
-		position += towrite;
-
-	}
-	// Update offset and size
-	inodes_x[fileDescriptor].offset += numBytes;
-	inodes[fileDescriptor].inode.size += numBytes;
-	return numBytes;
-	
+	return readed;
 }
 
 /*
- * @brief	Modifies the position of the seek pointer of a file.
- * @return	0 if succes, -1 otherwise.
+ * @brief	Writes a number of bytes into a file at a given position, without using
+ *          or changing the offset of the descriptor.
+ * @return	Number of bytes properly written, -1 in case of error.
  */
-int lseekFile(int fileDescriptor, long offset, int whence) {
+int writeFileAt(int fileDescriptor, void *buffer, int numBytes, long offset) {
 	if (!isMounted) {return -1;}
-	if ( fileDescriptor < 0 || fileDescriptor > MAX_FILE_NUM) {return -1;}
-	if (bitmap_getbit(superblock.inode_map, fileDescriptor) == 0) {return -1;}
-	if (inodes_x[fileDescriptor].state == CLOSE ) {return -1;}
-
-
-	if (inodes[fileDescriptor].type == LINK){
-		int source_fd = name_i(inodes[fileDescriptor].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		return lseekFile(source_fd, offset, whence);
+	if (numBytes < 0 || offset < 0 || offset > MAX_FILE_SIZE) {return -1;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	fs_iovec_t iov = { buffer, numBytes };
+	int writed = -1;
+	if (inode_id != -1){
+		writed = file_writev(inode_id, &iov, 1, offset);
 	}
-	
-	if (whence == FS_SEEK_BEGIN){
-		inodes_x[fileDescriptor].offset = 0;
-	}else if (whence == FS_SEEK_CUR){
-		int newPosition = (inodes_x[fileDescriptor].offset + offset);
-		if (newPosition < 0 || newPosition > MAX_FILE_SIZE){return -1;}
-		inodes_x[fileDescriptor].offset = newPosition; 
-	}else{
-		inodes_x[fileDescriptor].offset = inodes[fileDescriptor].inode.size;
-		
+	if (writed > 0){
+		file_grow(inode_id, offset + writed);
 	}
-	return 0;
+	pthread_rwlock_unlock(&data_lock);
+
+	return writed;
 }
 
 /*
- * @brief	Checks the integrity of the file.
- * @return	0 if success, -1 if the file is corrupted, -2 in case of error.
+ * @brief	Reads from a file into the segments of 'iov', in order.
+ * @return	Number of bytes properly read, -1 in case of error.
  */
+int readFilev(int fileDescriptor, fs_iovec_t *iov, int iovcnt) {
+	if (!isMounted) {return -1; }
+	if (iov_total(iov, iovcnt) == -1) { return -1; }
 
-int checkFile(char *fileName){
-	int inode_id;
-	if (!isMounted){return -2;}
-	if ((inode_id = name_i(fileName))==-1) {return -2;}
+	return fd_readv(fileDescriptor, iov, iovcnt);
+}
+
+/*
+ * @brief	Writes the segments of 'iov' into a file, in order.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+int writeFilev(int fileDescriptor, fs_iovec_t *iov, int iovcnt) {
+	if (!isMounted) {return -1;}
+	if (iov_total(iov, iovcnt) == -1) {return -1;}
 
+	return fd_writev(fileDescriptor, iov, iovcnt);
+}
 
-	if (inodes[inode_id].type == LINK){
-		int source_fd = name_i(inodes[inode_id].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		return checkFile(inodes[inode_id].soft_link.source);
+/*
+ * @brief	Gives the bytes of a range of a file as read-only slices of the block
+ *          cache, without copying them. They stay valid until releaseFileView.
+ * @return	Number of views stored (0 at the end of the file), -1 in case of error.
+ */
+int readFileView(int fileDescriptor, long offset, int len, fs_view_t *views, int max) {
+	if (!isMounted) {return -1;}
+	if (views == NULL || len < 0 || offset < 0 || offset > MAX_FILE_SIZE) {return -1;}
+
+	// Setting up views changes the cache, so it excludes everyone else
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	int count = -1;
+	if (inode_id != -1){
+		count = file_view(inode_id, offset, len, views, max);
 	}
+	pthread_rwlock_unlock(&data_lock);
 
-	char b[BLOCK_SIZE];
-	memset(b, '\0', BLOCK_SIZE);
+	return count;
+}
 
-	
-	int blocks[5];
-	int hasIntegrity = FALSE; 
-	memcpy(blocks,  inodes[inode_id].inode.direct_block, 5*sizeof(int));
-	for (int i = 0; i<sizeof(blocks)/sizeof(int); i++){
-		if (blocks[i] != -1 && inodes[inode_id].inode.crc[i] != 0){
-			hasIntegrity = TRUE;
-			if(bread(DEVICE_IMAGE, firstDataBlock + blocks[i], b) == -1){ return -2; }
-			uint32_t expected = CRC32((const unsigned char*)b, BLOCK_SIZE);
-			uint32_t got = inodes[inode_id].inode.crc[i];
-			if (expected != got ){
-				return -1;
-			}
-		}
+/*
+ * @brief	Gives back the views got from readFileView.
+ * @return	0 if success, -1 otherwise.
+ */
+int releaseFileView(fs_view_t *views, int count) {
+	if (views == NULL || count < 0) {return -1;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	for (int i = 0; i < count; i++){
+		bcache_unpin(views[i].base);
+		views[i].base = NULL;
+		views[i].len = 0;
 	}
-	if (hasIntegrity==FALSE){ return -2; }
-	
+	pthread_rwlock_unlock(&data_lock);
+
 	return 0;
 }
 
 /*
- * @brief	Include integrity on a file.
- * @return	0 if success, -1 if the file does not exists, -2 in case of error.
+ * @brief	Maps a range of a file into memory, filled with its contents.
+ * @return	Address of the mapping, NULL in case of error.
  */
-
-int includeIntegrity(char *fileName) {
-	int inode_id;
-	if (!isMounted){return -2;}
-	if ((inode_id = name_i(fileName))==-1) {return -1;}
-
-	char b[BLOCK_SIZE];
-
-	if (inodes[inode_id].type == LINK){
-		int source_fd = name_i(inodes[inode_id].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		return includeIntegrity(inodes[inode_id].soft_link.source);
+void *mmapFile(int fileDescriptor, long offset, int len, int prot) {
+	if (!isMounted) {return NULL;}
+	if (len <= 0 || offset < 0 || offset + len > MAX_FILE_SIZE) {return NULL;}
+	if (prot & ~(FS_PROT_READ | FS_PROT_WRITE)) {return NULL;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	void *addr = NULL;
+	if (inode_id != -1){
+		addr = map_create(inode_id, offset, len, prot);
 	}
-	
-	
-	int blocks[5];
-	memcpy(blocks,  inodes[inode_id].inode.direct_block, 5*sizeof(int));
-	for (int i = 0; i<sizeof(blocks)/sizeof(int); i++){
-		if (blocks[i] != -1){
-			if(bread(DEVICE_IMAGE, firstDataBlock + blocks[i], b)){return -2;};
-			uint32_t crc = CRC32((const unsigned char*)b, BLOCK_SIZE);
-			inodes[inode_id].inode.crc[i] = crc;
-		}
-	}
-	
-	return 0;
+	pthread_rwlock_unlock(&data_lock);
+
+	return addr;
 }
 
 /*
- * @brief	Opens an existing file and checks its integrity
- * @return	The file descriptor if possible, -1 if file does not exist, -2 if the file is corrupted, -3 in case of error
+ * @brief	Writes back to its file what was changed in a mapping.
+ * @return	0 if success, -1 otherwise.
  */
-int openFileIntegrity(char *fileName){
-	int inode_id;
-	if (!isMounted){return -3;} //Error
-	if ((inode_id = name_i(fileName))==-1) {return -1;} //File doesn't exist
-	
-	int err = checkFile(fileName);
-	if (err == -2) {return -3;} 	 // Error 
-	else if (err == -1) {return -2;} //File is corrupted
-	
-	err = openFile(fileName);
-	inodes_x[inode_id].integrity = TRUE;
-	if (err==-2) {return -3;}
+int msyncFile(void *addr) {
+	if (!isMounted) {return -1;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int map = map_find(addr), err = -1;
+	if (map != -1){
+		err = map_writeback(map);
+	}
+	pthread_rwlock_unlock(&data_lock);
+
 	return err;
 }
 
 /*
- * @brief	Closes a file and updates its integrity.
+ * @brief	Writes back a mapping and removes it.
  * @return	0 if success, -1 otherwise.
  */
-int closeFileIntegrity(int fileDescriptor) {
-	int err;
-	if (!isMounted){return -1;} //Error
-	if (inodes_x[fileDescriptor].integrity == FALSE) {return -1;}
-	
-	err = includeIntegrity(inodes[fileDescriptor].inode.name);
-	if (err < 0) {return -1;} 	 // Error 
-	
-	// Check if it's currently closed
-	if (inodes_x[fileDescriptor].state == CLOSE){ return -1;}
+int munmapFile(void *addr) {
+	if (!isMounted) {return -1;}
 
-	if (inodes[fileDescriptor].type == LINK){
-		int source_fd = name_i(inodes[fileDescriptor].soft_link.source);
-		if (source_fd < 0 ) {return -1;} 
-		int err = closeFile(source_fd);
-		if ( err < 0 ) { return -1; }
+	pthread_rwlock_wrlock(&data_lock);
+	int map = map_find(addr), err = -1;
+	if (map != -1){
+		err = map_release(map);
 	}
-	
-	//Close the file and return 0
-	inodes_x[fileDescriptor].state = CLOSE;
-	return 0;
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
 }
 
 /*
- * @brief	Creates a symbolic link to an existing file in the file system.
- * @return	0 if success, -1 if file does not exist, -2 in case of error.
+ * @brief	Modifies the position of the seek pointer of a file.
+ * @return	0 if succes, -1 otherwise.
  */
-int createLn(char *fileName, char *linkName){
-	if (!isMounted) {return -2;}
-	if (strlen(linkName) > MAX_FILE_SIZE ) {return -2;}
-	if (name_i(linkName) == 0) {return -2;}
-	if (name_i(fileName) < 0){return -1;}
-
-	int link = ialloc();
-	if (link < 0) {return -2;}
+int lseekFile(int fileDescriptor, long offset, int whence) {
+	if (!isMounted) {return -1;}
 
-	inodes[link].type = LINK;
-	strcpy(inodes[link].soft_link.source, fileName);
-	strcpy(inodes[link].soft_link.link, linkName);
+	// Readers move the offset too, and the size may be growing
+	pthread_rwlock_wrlock(&data_lock);
+	// Check that the descriptor is open and get the file it reaches
+	int inode_id = fd_inode(fileDescriptor);
+	int err = -1;
+	if (inode_id != -1){
+		err = 0;
+		if (whence == FS_SEEK_BEGIN){
+			files_x[fileDescriptor].offset = 0;
+		}else if (whence == FS_SEEK_CUR){
+			long newPosition = (files_x[fileDescriptor].offset + offset);
+			if (newPosition < 0 || newPosition > MAX_FILE_SIZE){
+				err = -1;
+			} else {
+				files_x[fileDescriptor].offset = newPosition;
+			}
+		}else{
+			files_x[fileDescriptor].offset = inodes[inode_id].inode.size;
+		}
+	}
+	pthread_rwlock_unlock(&data_lock);
 
-	return 0;
+	return err;
 }
 
 /*
- * @brief 	Deletes an existing symbolic link
- * @return 	0 if the file is correct, -1 if the symbolic link does not exist, -2 in case of error.
+ * @brief	Reserves disk blocks for a range of a file.
+ * @return	0 if success, -1 otherwise.
  */
-int removeLn(char *linkName) {
-	if (!isMounted) {return -2;}
-	int inode_id = name_i(linkName);
-	if (inode_id < 0) {return -1;}
+int fallocateFile(int fileDescriptor, long offset, long len, int flags) {
+	if (!isMounted) {return -1;}
+	if (offset < 0 || len <= 0 || offset + len > MAX_FILE_SIZE) {return -1;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	// Check that the descriptor is open and get the file it reaches
+	int inode_id = fd_inode(fileDescriptor);
+	int err = -1;
+	if (inode_id != -1){
+		err = file_fallocate(inode_id, offset, len, flags);
+	}
+	pthread_rwlock_unlock(&data_lock);
 
-	if (ifree(inode_id) < 0) {return -2; }
-	return 0;
+	return err;
 }
 
-/*------------ Auxiliar functions ---------------------*/
-
 /*
- * @brief 	Allocates a inode in memory
- * @return 	Position if success, -1 otherwise.
+ * @brief	Sets the size of a file, releasing the blocks past the new end.
+ * @return	0 if success, -1 otherwise.
  */
-int ialloc(void){
-
-	// search for the first free inode
-	for (int i = 0; i < MAX_FILE_NUM; i++){
-		if (bitmap_getbit(superblock.inode_map, i) == 0) {
-			bitmap_setbit(superblock.inode_map, i, 1); // Set it as occupied
-			// Check if the first free inode it's in first inode block
-			memset(&(inodes[i]), '\0', sizeof(inode_t));	
-			// We return it's position
-			return i;
-		}
+int truncateFile(int fileDescriptor, long len) {
+	if (!isMounted) {return -1;}
+	if (len < 0 || len > MAX_FILE_SIZE) {return -1;}
+
+	// Appends in flight would grow the file again: wait for none
+	pthread_mutex_lock(&append_lock);
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	int err = -1;
+	if (inode_id != -1 && atomic_load(&inodes_x[inode_id].append_end) == inodes_x[inode_id].append_done){
+		err = file_truncate(inode_id, len);
 	}
-	// Return -1 if not found
-	return -1;
+	pthread_rwlock_unlock(&data_lock);
+	pthread_mutex_unlock(&append_lock);
+
+	return err;
 }
 
 /*
- * @brief 	Allocates a block in disk
- * @return 	Position if success, -1 otherwise.
+ * @brief	Zeroes a range of a file, releasing the blocks fully inside it.
+ * @return	0 if success, -1 otherwise.
  */
-int balloc(void){
+int punchHole(int fileDescriptor, long offset, long len) {
+	if (!isMounted) {return -1;}
+	if (offset < 0 || len <= 0 || offset + len > MAX_FILE_SIZE) {return -1;}
 
-	// We define a dummy block for writing in memory
-	char b[BLOCK_SIZE];
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = fd_inode(fileDescriptor);
+	int err = -1;
+	if (inode_id != -1){
+		err = file_punch(inode_id, offset, len);
+	}
+	pthread_rwlock_unlock(&data_lock);
 
-	// Search for first free block
-	for (int i = 0; i < superblock.block_num; ++i) {
-		if (bitmap_getbit(superblock.block_map, i) == 0){
-			bitmap_setbit(superblock.block_map, i, 1); // Set it as occupied
+	return err;
+}
+
+/*
+ * @brief	Checks the integrity of the file.
+ * @return	0 if success, -1 if the file is corrupted, -2 in case of error.
+ */
+
+int checkFile(char *fileName){
+	if (!isMounted){return -2;}
+
+	// Checking flushes the delayed buffers of the file
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = name_file(fileName);
+	int err = -2;
+	if (inode_id >= 0){
+		err = crc_check(inode_id);
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief	Include integrity on a file.
+ * @return	0 if success, -1 if the file does not exists, -2 in case of error.
+ */
+
+int includeIntegrity(char *fileName) {
+	if (!isMounted){return -2;}
+
+	// Including flushes the delayed buffers of the file
+	pthread_rwlock_wrlock(&data_lock);
+	int err = name_file(fileName);
+	if (err >= 0){
+		err = (crc_include(err) == -1) ? -2 : 0;
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief	Opens an existing file and checks its integrity
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 if the file is corrupted, -3 in case of error
+ */
+int openFileIntegrity(char *fileName){
+	if (!isMounted){return -3;} //Error
+
+	pthread_rwlock_wrlock(&data_lock);
+	int fd = -3;
+	int inode_id = name_file(fileName);
+	if (inode_id == -1){
+		fd = -1; //File doesn't exist
+	} else if (inode_id >= 0){
+		int err = crc_check(inode_id);
+		if (err == -1){
+			fd = -2; //File is corrupted
+		} else if (err == 0 && (fd = fd_alloc(inode_id)) != -1){
+			files_x[fd].flags |= FD_INTEGRITY;
+		} else {
+			fd = -3; // Error
+		}
+	}
+	pthread_rwlock_unlock(&data_lock);
 
-			// We write the dummy block
-			memset(b, '\0', BLOCK_SIZE);
-			bwrite(DEVICE_IMAGE, firstDataBlock + i, b);
+	return fd;
+}
 
-			// We return it's position
-			return i;
+/*
+ * @brief	Closes a file and updates its integrity.
+ * @return	0 if success, -1 otherwise.
+ */
+int closeFileIntegrity(int fileDescriptor) {
+	int err;
+	if (!isMounted){return -1;} //Error
+	if (fileDescriptor < 0 || fileDescriptor >= MAX_OPEN_FILES){ return -1; }
+
+	pthread_rwlock_wrlock(&data_lock);
+	// Check if it's currently closed, or opened without integrity
+	err = -1;
+	if (files_x[fileDescriptor].state == OPEN && (files_x[fileDescriptor].flags & FD_INTEGRITY)){
+		// The checksums cover what was changed through its mappings.
+		// A removed file has nothing left to check
+		int inode_id = fd_inode(fileDescriptor);
+		err = 0;
+		if (inode_id != -1){
+			err = map_sync(inode_id);
+		}
+		if (inode_id != -1 && err == 0){
+			err = crc_include(inode_id);
+		}
+		//Close the file
+		if (err == 0){
+			err = fd_release(fileDescriptor);
 		}
 	}
-	// Return -1 if not found
-	return -1;
+	pthread_rwlock_unlock(&data_lock);
+
+	return (err < 0) ? -1 : 0;
+}
+
+/*
+ * @brief	Creates a new file sharing the data blocks of an existing one.
+ * @return	0 if success, -1 if the source does not exist, -2 in case of error.
+ */
+int cloneFile(char *srcName, char *dstName) {
+	if (!isMounted) {return -2;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int err = name_file(srcName);
+	if (err >= 0){
+		err = (inode_map_x.nfree > 0 && file_clone(err, dstName) >= 0) ? 0 : -2;
+	}
+	if (err == 0){
+		superblock.num_inodes++;
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief	Creates a symbolic link to an existing file in the file system.
+ * @return	0 if success, -1 if file does not exist, -2 in case of error.
+ */
+int createLn(char *fileName, char *linkName){
+	if (!isMounted) {return -2;}
+	if (strlen(fileName) >= MAX_NAME_LENGHT) {return -2;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int err = -2;
+	if (name_i(linkName) == -1){
+		err = -1;
+		if (name_i(fileName) >= 0){
+			int link = i_create(linkName, LINK);
+			err = -2;
+			if (link >= 0){
+				strcpy(inodes[link].soft_link.source, fileName);
+				err = 0;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief 	Deletes an existing symbolic link
+ * @return 	0 if the file is correct, -1 if the symbolic link does not exist, -2 in case of error.
+ */
+int removeLn(char *linkName) {
+	if (!isMounted) {return -2;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int err = -1;
+	int inode_id = name_i(linkName);
+	if (inode_id >= 0){
+		err = (inodes[inode_id].type == LINK && i_remove(inode_id) == 0) ? 0 : -2;
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*
+ * @brief	Creates a new directory, provided it doesn't exist in the file system.
+ * @return	0 if success, -1 if the directory already exists, -2 in case of error.
+ */
+int mkDir(char *path) {
+	if (!isMounted) {return -2;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int inode_id = -2;
+	if (inode_map_x.nfree > 0){
+		inode_id = i_create(path, DIRECTORY);
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return (inode_id < 0) ? inode_id : 0;
+}
+
+/*
+ * @brief	Deletes an empty directory.
+ * @return	0 if success, -1 if the directory does not exist, -2 in case of error.
+ */
+int rmDir(char *path) {
+	if (!isMounted) {return -2;}
+
+	pthread_rwlock_wrlock(&data_lock);
+	int err = -1;
+	int inode_id = name_i(path);
+	if (inode_id >= 0){
+		// The root and directories with entries can't be removed
+		err = -2;
+		if (inodes[inode_id].type == DIRECTORY && inode_id != ROOT_DIR &&
+		    inodes[inode_id].inode.size == 0 && i_remove(inode_id) == 0){
+			err = 0;
+		}
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return err;
+}
+
+/*------------ Auxiliar functions ---------------------*/
+
+/*
+ * @brief 	Writes an empty file system of 'deviceSize' bytes
+ * @return 	0 if success, -1 otherwise.
+ */
+int mkfs_init(long deviceSize) {
+
+	// Set default settings
+	superblock.magic_num = MAGIC_NUM;
+	superblock.num_inodes = 0;
+	superblock.device_size = deviceSize;
+	superblock.block_num = deviceSize/BLOCK_SIZE;
+	
+	
+	// Set all inode_map and block_map bits to 0 (free),
+	// and the name filter to no names
+	memset(superblock.inode_map, 0, sizeof(superblock.inode_map));
+	memset(superblock.block_map, 0, sizeof(superblock.block_map));
+	memset(superblock.name_bloom, 0, sizeof(superblock.name_bloom));
+	memset(superblock.block_refs, 0, sizeof(superblock.block_refs));
+	bitmap_x_init(&inode_map_x, MAX_FILE_NUM);
+	bitmap_x_init(&block_map_x, data_block_num());
+	
+	// Initialize all inodes to 0
+	for (int i=0; i < MAX_FILE_NUM; i++) {
+        memset(&(inodes[i]), '\0', sizeof(inode_t) );
+    }
+
+	// Names cached from the previous file system don't exist in this one
+	if (nhash_reset() == -1) {
+		return -1;
+	}
+	memset(path_cache_x, 0, sizeof(path_cache_x));
+
+	// The root directory takes the first inode, empty
+	if (ialloc() != ROOT_DIR) {
+		return -1;
+	}
+	inodes[ROOT_DIR].type = DIRECTORY;
+	for (int i = 0; i < 5; i++) {
+		inodes[ROOT_DIR].inode.direct_block[i] = -1;
+	}
+	
+	// Data blocks are not reset: free blocks are never read, and
+	// allocated ones are unwritten until they get data. Just check
+	// that the device is large enough to hold all of them
+	char last_block[BLOCK_SIZE];
+	if (bread(DEVICE_IMAGE, firstDataBlock + data_block_num() - 1, last_block) == -1) {
+		return -1;
+	}
+
+	if (meta_writeToDisk() == -1){
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief 	Reads the metadata from disk and resets the state kept only in memory
+ * @return 	0 if success, -1 otherwise.
+ */
+int mount_init(void) {
+	if (meta_readFromDisk() == -1){
+		return -1;
+	}
+	for (int i = 0; i < MAX_DIRTY_BUFFERS; i++){
+		dirty_x[i].inode = -1;
+	}
+	for (int i = 0; i < MAX_CACHED_BLOCKS; i++){
+		bcache_x[i].block = -1;
+		bcache_x[i].pins = 0;
+	}
+	if (nhash_reset() == -1){
+		return -1;
+	}
+	memset(path_cache_x, 0, sizeof(path_cache_x));
+	memset(files_x, 0, sizeof(files_x));
+	for (int i = 0; i < MAX_FILE_NUM; i++){
+		inodes_x[i].append_done = inodes[i].inode.size;
+		atomic_store(&inodes_x[i].append_end, inodes[i].inode.size);
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Releases the mappings and writes everything still in memory to disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int mount_flush(void) {
+	// Mappings don't outlive the file system
+	for (int i = 0; i < MAX_MAPS; i++){
+		if (maps_x[i].addr != NULL && map_release(i) == -1){
+			return -1;
+		}
+	}
+	if (dbuf_flush(-1) == -1){
+		return -1;
+	}
+	return meta_writeToDisk();
+}
+
+/*
+ * @brief 	Allocates a inode in memory
+ * @return 	Position if success, -1 otherwise.
+ */
+int ialloc(void){
+
+	// Take the next free inode after the last one allocated
+	int i = bitmap_alloc(superblock.inode_map, MAX_FILE_NUM, &inode_map_x);
+	if (i == -1) { return -1; }
+
+	// A new file is appended to from its start
+	inodes_x[i].append_done = 0;
+	atomic_store(&inodes_x[i].append_end, 0);
+	memset(&(inodes[i]), '\0', sizeof(inode_t));
+	return i;
+}
+
+/*
+ * @brief 	Allocates a run of contiguous blocks near 'goal'
+ * @return 	First block of the run if success, -1 otherwise.
+ */
+int balloc_range(int goal, int min_len, int max_len, int *len){
+	int nblocks = data_block_num();
+	if (min_len < 1 || max_len < min_len) { return -1; }
+	if (block_map_x.nfree - block_map_x.nreserved < min_len) { return -1; }
+	if (goal < 0 || goal >= nblocks) { goal = 0; }
+
+	// Walk the free runs from 'goal' to the end and then from the start
+	// back to 'goal'. The first run that fits 'max_len' wins, otherwise
+	// the longest run of at least 'min_len' blocks.
+	int best = -1, best_len = 0;
+	for (int pass = 0; pass < 2 && best_len < max_len; pass++) {
+		int pos = (pass == 0) ? goal : 0;
+		int end = (pass == 0) ? nblocks : goal;
+		while (pos < end) {
+			int start = bitmap_find(superblock.block_map, pos, end, 0);
+			if (start == -1) { break; }
+			int stop = bitmap_find(superblock.block_map, start, end, 1);
+			if (stop == -1) { stop = end; }
+			if (stop - start > best_len) {
+				best = start;
+				best_len = stop - start;
+				if (best_len >= max_len) { break; }
+			}
+			pos = stop;
+		}
+	}
+	if (best == -1 || best_len < min_len) { return -1; }
+	if (best_len > max_len) { best_len = max_len; }
+
+	// Mark the run as occupied. Its old contents are left on disk,
+	// the owner tracks the blocks as unwritten until they get data
+	for (int i = best; i < best + best_len; i++) {
+		bitmap_setbit(superblock.block_map, i, 1);
+	}
+	block_map_x.nfree -= best_len;
+	block_map_x.rotor = (best + best_len < nblocks) ? best + best_len : 0;
+
+	if (len != NULL) { *len = best_len; }
+	return best;
 }
 
 /*
@@ -594,13 +914,19 @@ int balloc(void){
  */
 int ifree(int inode_id) {
 	// Check that inode_id is a legal and non-free id
-	if (inode_id > MAX_FILE_NUM){ return -1; } 
+	if (inode_id < 0 || inode_id >= MAX_FILE_NUM){ return -1; } 
 	if (bitmap_getbit(superblock.inode_map, inode_id) == 0){
 		return -1;
 	}
 
-	// free inode
-	bitmap_setbit(superblock.inode_map, inode_id, 0);
+	// free inode and its name. Descriptors still
+	// reaching it see the new generation
+	nhash_remove(inode_id);
+	pcache_forget_inode(inode_id);
+	inodes_x[inode_id].generation++;
+	inodes_x[inode_id].append_done = 0;
+	atomic_store(&inodes_x[inode_id].append_end, 0);
+	bitmap_release(superblock.inode_map, inode_id, &inode_map_x);
 	//Set inode to 0
 	memset(&(inodes[inode_id]), '\0', sizeof(inode_t));	
 	
@@ -612,19 +938,41 @@ int ifree(int inode_id) {
  * @return 	0 if success, -1 otherwise.
  */
 int bfree(int block_id){
-	// Check that inode_id is a legal and non-free id
-	if (block_id > superblock.block_num) { return -1; }
-	if (bitmap_getbit(superblock.block_map, block_id) == 0){
-		return -1;
+	return bfree_run(block_id, 1);
+}
+
+/*
+ * @brief 	Free 'count' consecutive blocks in memory
+ * @return 	0 if success, -1 otherwise.
+ */
+int bfree_run(int block_id, int count){
+	// Check that every block is a legal and non-free id
+	if (count < 1 || block_id < 0 || block_id + count > data_block_num()) { return -1; }
+	for (int i = block_id; i < block_id + count; i++){
+		if (bitmap_getbit(superblock.block_map, i) == 0){
+			return -1;
+		}
 	}
 
-	// free the bit in the bitmap
-	bitmap_setbit(superblock.block_map, block_id, 0);
-	
-	// free the block in memory
-	char b[BLOCK_SIZE]; // dummy block for reseting 
-	memset(b, '\0', BLOCK_SIZE);
-	bwrite(DEVICE_IMAGE, firstDataBlock + block_id, b);
+	// Shared blocks just lose an owner. Free the bits of the others in the
+	// bitmap: their contents are never read again so their space is given
+	// back to the host, one discard per run
+	int run = 0;
+	for (int i = block_id; i <= block_id + count; i++){
+		if (i < block_id + count && superblock.block_refs[i] == 0){
+			bitmap_release(superblock.block_map, i, &block_map_x);
+			bcache_forget(i);
+			run++;
+			continue;
+		}
+		if (i < block_id + count){
+			superblock.block_refs[i]--;
+		}
+		if (run > 0){
+			bdiscard(DEVICE_IMAGE, firstDataBlock + i - run, run);
+			run = 0;
+		}
+	}
 	return 0;
 }
 
@@ -633,62 +981,1316 @@ int bfree(int block_id){
  * @return 	inode id if success, -1 otherwise.
  */
 int name_i(char *fname){
+	char path[MAX_PATH_LENGHT];
 
-	// search an i-node with name <fname> in the first inode block
-	for (int i = 0; i < MAX_FILE_NUM; i++){
-		if (inodes[i].type == INODE){
-			if (!strcmp(inodes[i].inode.name, fname)){
-				//Return de inode id
-				return i;
-			}
-		}else{ 
-			if (!strcmp(inodes[i].soft_link.link, fname)){
-				//Return de inode id
-				return i;
-			}
+	// Paths too long for the cache are always walked
+	if (path_canonical(fname, path) == -1){
+		return namei_len(fname, strlen(fname));
+	}
+
+	// Answer from the cache, remembering also
+	// the paths that do not exist
+	int slot = fnv_hash(path) & (PATH_CACHE_SIZE - 1);
+	if (path_cache_x[slot].valid && !strcmp(path_cache_x[slot].path, path)){
+		return path_cache_x[slot].inode_id;
+	}
+
+	int inode_id = namei_len(path, strlen(path));
+	path_cache_x[slot].valid = TRUE;
+	path_cache_x[slot].inode_id = inode_id;
+	strcpy(path_cache_x[slot].path, path);
+	return inode_id;
+}
+
+/*
+ * @brief 	Copies a path to 'canonical' without empty components (repeated,
+ *          leading or trailing '/'). 'canonical' holds MAX_PATH_LENGHT characters.
+ * @return 	Length of the canonical path if success, -1 if it does not fit.
+ */
+int path_canonical(char *path, char *canonical){
+	int len = 0;
+
+	for (int i = 0; path[i] != '\0'; i++){
+		if (path[i] == '/' && (len == 0 || canonical[len-1] == '/')){ continue; }
+		if (len == MAX_PATH_LENGHT - 1){ return -1; }
+		canonical[len++] = path[i];
+	}
+	if (len > 0 && canonical[len-1] == '/'){ len--; }
+	canonical[len] = '\0';
+	return len;
+}
+
+/*
+ * @brief 	Forgets the cached lookup of a path
+ * @return 	0 if success, -1 otherwise.
+ */
+int pcache_forget(char *path){
+	char canonical[MAX_PATH_LENGHT];
+	if (path_canonical(path, canonical) == -1){ return -1; }
+
+	int slot = fnv_hash(canonical) & (PATH_CACHE_SIZE - 1);
+	if (!strcmp(path_cache_x[slot].path, canonical)){
+		path_cache_x[slot].valid = FALSE;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Forgets the cached lookups that found an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int pcache_forget_inode(int inode_id){
+	for (int slot = 0; slot < PATH_CACHE_SIZE; slot++){
+		if (path_cache_x[slot].inode_id == inode_id){
+			path_cache_x[slot].valid = FALSE;
 		}
-	}	
+	}
+	return 0;
+}
 
-	//Return -1 if not found
-	return -1;
+/*
+ * @brief 	Search for the inode of the first 'len' characters of a path
+ * @return 	inode id if success, -1 otherwise.
+ */
+int namei_len(char *path, int len){
+	char name[MAX_NAME_LENGHT];
+	int inode_id = ROOT_DIR;
+
+	// Walk the path one component at a time
+	for (int pos = 0; pos < len; ){
+		if (path[pos] == '/'){ pos++; continue; }
+
+		int end = pos;
+		while (end < len && path[end] != '/'){ end++; }
+		if (end - pos >= MAX_NAME_LENGHT){ return -1; }
+		if (inodes[inode_id].type != DIRECTORY){ return -1; }
+
+		memcpy(name, &path[pos], end - pos);
+		name[end - pos] = '\0';
+		inode_id = dir_lookup(inode_id, name);
+		if (inode_id == -1){ return -1; }
+		pos = end;
+	}
+	return inode_id;
 }
 
 /*
- * @brief 	Gives the datablock where the file with offset is
- * @return 	block id if success, -1 otherwise.
+ * @brief 	Search for the directory holding the last component of a path,
+ *          which is copied to 'name'
+ * @return 	inode id of the directory if success, -1 otherwise.
  */
-int b_map(int inode_id, int offset) {
+int namei_parent(char *path, char *name){
+	int len = strlen(path);
+	int start = len;
+	while (start > 0 && path[start-1] != '/'){ start--; }
+
+	// The last component must be a legal name
+	if (len == start || len - start >= MAX_NAME_LENGHT){ return -1; }
+	strcpy(name, &path[start]);
+
+	int dir = namei_len(path, start);
+	if (dir == -1 || inodes[dir].type != DIRECTORY){ return -1; }
+	return dir;
+}
 
-	// Check that the inode_id is legal and non-free
-	if (inode_id>MAX_FILE_NUM) {return -1;}
-	if (bitmap_getbit(superblock.inode_map, inode_id) == 0){
+/*
+ * @brief 	Search for the entry 'name' of a directory
+ * @return 	inode id if success, -1 otherwise.
+ */
+int dir_lookup(int dir, char *name){
+
+	// Names the filter has never seen are not looked for
+	if (!bloom_maybe(dir, name)){
 		return -1;
 	}
-	
-	int block = offset/BLOCK_SIZE; // Calculate the block of this offset
-	// Check if it's alredy initializated and it not
-	// make a balloc, finally return the block number
-	if (inodes[inode_id].inode.direct_block[block] == -1 ){
-		int block_id = balloc();
-		inodes[inode_id].inode.direct_block[block] = block_id;
-	}
-	return inodes[inode_id].inode.direct_block[block];
-	
 
+	// The entries of the block of the name must be in the index
+	int bucket = dir_bucket(name);
+	if (!bitmap_getbit(dir_loaded_x[dir], bucket) && dir_load(dir, bucket) == -1){
+		return -1;
+	}
+
+	// Probe the name index from the slot of the name
+	// until the entry or an empty slot is found
+	for (int slot = name_hash(dir, name); name_hash_x[slot] != -1; slot = (slot + 1) & (NAME_HASH_SIZE - 1)){
+		int inode_id = name_hash_x[slot];
+		if (parent_x[inode_id] == dir && !strcmp(inode_name(inode_id), name)){
+			return inode_id;
+		}
+	}
 	return -1;
 }
 
 /*
- * @brief 	Read metadata from disk to memory
+ * @brief 	Adds the entries of a directory block to the name index
  * @return 	0 if success, -1 otherwise.
  */
-int meta_readFromDisk(void){
+int dir_load(int dir, int bucket){
+	dirblock_t b;
 
-	char b[BLOCK_SIZE];
+	if (inodes[dir].inode.direct_block[bucket] != -1){
+		if (b_read(dir, bucket, b.data) == -1){ return -1; }
 
-	// Read the superblock from disk to memory
-	if (bread(DEVICE_IMAGE, SuperBlock_Block, b) == -1){return -1;}
-	memcpy((char*)&superblock, b, BLOCK_SIZE);
+		for (int i = 0; i < DIRENTS_PER_BLOCK; i++){
+			int inode_id = b.entries[i].inode_id;
+			if (b.entries[i].name[0] == '\0'){ continue; }
+			if (inode_id <= ROOT_DIR || inode_id >= MAX_FILE_NUM){ return -1; }
+
+			parent_x[inode_id] = dir;
+			nhash_insert(inode_id);
+		}
+	}
+	bitmap_setbit(dir_loaded_x[dir], bucket, 1);
+	return 0;
+}
+
+/*
+ * @brief 	Adds the entries of every directory to the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_load_all(void){
+	for (int dir = 0; dir < MAX_FILE_NUM; dir++){
+		if (bitmap_getbit(superblock.inode_map, dir) == 0 || inodes[dir].type != DIRECTORY){ continue; }
+
+		for (int bucket = 0; bucket < 5; bucket++){
+			if (!bitmap_getbit(dir_loaded_x[dir], bucket) && dir_load(dir, bucket) == -1){
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Adds an entry for an inode to a directory block
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_add(int dir, int inode_id){
+	char *name = inode_name(inode_id);
+	int bucket = dir_bucket(name);
+	dirblock_t b;
+
+	if (inodes[dir].inode.direct_block[bucket] == -1 && b_alloc(dir, bucket, 1) == -1){ return -1; }
+	if (b_read(dir, bucket, b.data) == -1){ return -1; }
+
+	for (int i = 0; i < DIRENTS_PER_BLOCK; i++){
+		if (b.entries[i].name[0] == '\0'){
+			strcpy(b.entries[i].name, name);
+			b.entries[i].inode_id = inode_id;
+			if (bwrite(DEVICE_IMAGE, firstDataBlock + inodes[dir].inode.direct_block[bucket], b.data) == -1){ return -1; }
+			bitmap_setbit(inodes[dir].inode.unwritten, bucket, 0);
+			inodes[dir].inode.size++;
+			return 0;
+		}
+	}
+	// The block of the name is full
+	return -1;
+}
+
+/*
+ * @brief 	Removes the entry of an inode from a directory block
+ * @return 	0 if success, -1 otherwise.
+ */
+int dir_remove(int dir, int inode_id){
+	char *name = inode_name(inode_id);
+	int bucket = dir_bucket(name);
+	dirblock_t b;
+
+	if (b_read(dir, bucket, b.data) == -1){ return -1; }
+
+	for (int i = 0; i < DIRENTS_PER_BLOCK; i++){
+		if (b.entries[i].inode_id == inode_id && !strcmp(b.entries[i].name, name)){
+			memset(&b.entries[i], '\0', sizeof(dirent_t));
+			if (bwrite(DEVICE_IMAGE, firstDataBlock + inodes[dir].inode.direct_block[bucket], b.data) == -1){ return -1; }
+			inodes[dir].inode.size--;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * @brief 	Creates an inode of type 'type' for a path, with no data
+ * @return 	inode id if success, -1 if the path already exists, -2 in case of error.
+ */
+int i_create(char *path, int type){
+	char name[MAX_NAME_LENGHT];
+
+	int dir = namei_parent(path, name);
+	if (dir == -1){ return -2; }
+	if (dir_lookup(dir, name) != -1){ return -1; }
+
+	int inode_id = ialloc();
+	if (inode_id == -1){ return -2; }
+
+	inodes[inode_id].type = type;
+	if (type != LINK){
+		for (int i = 0; i < 5; i++){
+			inodes[inode_id].inode.direct_block[i] = -1;
+			inodes[inode_id].inode.crc[i] = 0;
+		}
+	}
+	strcpy(inode_name(inode_id), name);
+	parent_x[inode_id] = dir;
+
+	// A new directory has no entries to load
+	dir_loaded_x[inode_id][0] = (type == DIRECTORY) ? 0x1f : 0;
+
+	if (dir_add(dir, inode_id) == -1){
+		ifree(inode_id);
+		return -2;
+	}
+	nhash_insert(inode_id);
+	bloom_update(dir, name, 1);
+
+	// The path may be cached as missing
+	pcache_forget(path);
+	return inode_id;
+}
+
+/*
+ * @brief 	Removes an inode from its directory and frees it with its blocks
+ * @return 	0 if success, -1 otherwise.
+ */
+int i_remove(int inode_id){
+	if (dir_remove(parent_x[inode_id], inode_id) == -1){ return -1; }
+	bloom_update(parent_x[inode_id], inode_name(inode_id), -1);
+
+	// Free the direct blocks, and forget the data that never reached the disk
+	if (inodes[inode_id].type != LINK && file_release(inode_id, 0, 4) == -1){
+		return -1;
+	}
+	return ifree(inode_id);
+}
+
+/*
+ * @brief 	Adds the name of an inode to the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_insert(int inode_id){
+	int slot = name_hash(parent_x[inode_id], inode_name(inode_id));
+
+	// The table is larger than the inode table, so there is always an empty slot
+	while (name_hash_x[slot] != -1){
+		if (name_hash_x[slot] == inode_id){ return -1; }
+		slot = (slot + 1) & (NAME_HASH_SIZE - 1);
+	}
+	name_hash_x[slot] = inode_id;
+	return 0;
+}
+
+/*
+ * @brief 	Removes the name of an inode from the name index
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_remove(int inode_id){
+	int slot = name_hash(parent_x[inode_id], inode_name(inode_id));
+
+	while (name_hash_x[slot] != inode_id){
+		if (name_hash_x[slot] == -1){ return -1; }
+		slot = (slot + 1) & (NAME_HASH_SIZE - 1);
+	}
+
+	// Empty the slot and move back the entries after it that
+	// can't be found anymore, so no tombstones are needed
+	name_hash_x[slot] = -1;
+	for (int next = (slot + 1) & (NAME_HASH_SIZE - 1); name_hash_x[next] != -1; next = (next + 1) & (NAME_HASH_SIZE - 1)){
+		int id = name_hash_x[next];
+		int home = name_hash(parent_x[id], inode_name(id));
+		// Move it if its home slot is not in (slot, next]
+		if (((next - home) & (NAME_HASH_SIZE - 1)) >= ((next - slot) & (NAME_HASH_SIZE - 1))){
+			name_hash_x[slot] = id;
+			name_hash_x[next] = -1;
+			slot = next;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Resets the name index. Directory blocks are loaded into it as lookups reach them
+ * @return 	0 if success, -1 otherwise.
+ */
+int nhash_reset(void){
+	for (int i = 0; i < NAME_HASH_SIZE; i++){
+		name_hash_x[i] = -1;
+	}
+	for (int i = 0; i < MAX_FILE_NUM; i++){
+		parent_x[i] = -1;
+		dir_loaded_x[i][0] = 0;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Follows a chain of links up to the file it reaches
+ * @return 	inode id of the file if success, -1 if a link is broken or the chain loops.
+ */
+int i_follow(int inode_id){
+	for (int depth = 0; depth <= MAX_LINK_DEPTH; depth++){
+		if (inodes[inode_id].type != LINK){
+			return inodes[inode_id].type == INODE ? inode_id : -1;
+		}
+		inode_id = name_i(inodes[inode_id].soft_link.source);
+		if (inode_id == -1){ return -1; }
+	}
+	return -1;
+}
+
+/*
+ * @brief 	Gives the file a path reaches once its links are followed
+ * @return 	inode id of the file if success, -1 if the path does not exist,
+ *          -2 if it is a directory or a link that reaches no file.
+ */
+int name_file(char *path){
+	int inode_id = name_i(path);
+	if (inode_id == -1){ return -1; }
+	if (inodes[inode_id].type == DIRECTORY){ return -2; }
+
+	inode_id = i_follow(inode_id);
+	if (inode_id == -1){ return -2; }
+	return inode_id;
+}
+
+/*
+ * @brief 	Gives the file reached by an open descriptor, checking that it was not removed since
+ * @return 	inode id of the file if success, -1 otherwise.
+ */
+int fd_inode(int fd){
+	if (fd < 0 || fd >= MAX_OPEN_FILES){ return -1; }
+	if (files_x[fd].state == CLOSE){ return -1; }
+
+	int inode_id = files_x[fd].inode;
+	if (inodes_x[inode_id].generation != files_x[fd].generation){ return -1; }
+	return inode_id;
+}
+
+/*
+ * @brief 	Takes a free entry of the open file table for an inode. Needs data_lock held exclusively
+ * @return 	file descriptor if success, -1 if the table is full.
+ */
+int fd_alloc(int inode_id){
+	for (int fd = 0; fd < MAX_OPEN_FILES; fd++){
+		if (files_x[fd].state == OPEN){ continue; }
+
+		files_x[fd].state = OPEN;
+		files_x[fd].inode = inode_id;
+		files_x[fd].generation = inodes_x[inode_id].generation;
+		files_x[fd].offset = 0;
+		files_x[fd].flags = 0;
+		return fd;
+	}
+	return -1;
+}
+
+/*
+ * @brief 	Frees an entry of the open file table. Needs data_lock held exclusively
+ * @return 	0 if success, -1 otherwise.
+ */
+int fd_release(int fd){
+	if (fd < 0 || fd >= MAX_OPEN_FILES){ return -1; }
+	if (files_x[fd].state == CLOSE){ return -1; }
+
+	files_x[fd].state = CLOSE;
+	return 0;
+}
+
+/*
+ * @brief 	Checks the blocks of an inode against their stored CRC
+ * @return 	0 if success, -1 if the file is corrupted, -2 in case of error.
+ */
+int crc_check(int inode_id){
+	char b[BLOCK_SIZE];
+
+	// The checksums cover what is on disk
+	if (dbuf_flush(inode_id) == -1) { return -2; }
+	
+	int hasIntegrity = FALSE; 
+	for (int i = 0; i < 5; i++){
+		if (inodes[inode_id].inode.direct_block[i] != -1 && inodes[inode_id].inode.crc[i] != 0){
+			hasIntegrity = TRUE;
+			if(b_read(inode_id, i, b) == -1){ return -2; }
+			uint32_t expected = CRC32((const unsigned char*)b, BLOCK_SIZE);
+			uint32_t got = inodes[inode_id].inode.crc[i];
+			if (expected != got ){
+				return -1;
+			}
+		}
+	}
+	if (hasIntegrity==FALSE){ return -2; }
+	
+	return 0;
+}
+
+/*
+ * @brief 	Stores the CRC of every block of an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int crc_include(int inode_id){
+	char b[BLOCK_SIZE];
+
+	// The checksums cover what is on disk
+	if (dbuf_flush(inode_id) == -1) { return -1; }
+	
+	for (int i = 0; i < 5; i++){
+		if (inodes[inode_id].inode.direct_block[i] != -1){
+			if(b_read(inode_id, i, b)){return -1;};
+			uint32_t crc = CRC32((const unsigned char*)b, BLOCK_SIZE);
+			inodes[inode_id].inode.crc[i] = crc;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * @brief 	Reads bytes of an inode starting at 'position' into the segments of 'iov',
+ *          reading each block once whatever the number of segments it spans
+ * @return 	Number of bytes read, -1 in case of error.
+ */
+int file_readv(int inode_id, fs_iovec_t *iov, int iovcnt, int position) {
+	int size = inodes[inode_id].inode.size;
+	int numBytes = iov_total(iov, iovcnt);
+	int readed = 0, toread = 0;
+	iov_cursor_t cursor = { iov, 0, 0 };
+	char b[BLOCK_SIZE];
+
+	if (numBytes == -1){ return -1; }
+	if (numBytes == 0 || position >= size){ return 0; }
+
+	// If the bytes to read are greater than the available bytes
+	//  then read only the bytes available
+	if (numBytes > size - position){
+		numBytes = size - position;
+	}
+
+	while (readed < numBytes){
+		// Read up to the end of the current block
+		toread = BLOCK_SIZE - position%BLOCK_SIZE;
+		if (toread > numBytes - readed){
+			toread = numBytes - readed;
+		}
+
+		char *frame = b;
+		if (b_lookup(inode_id, position) == -1){
+			// Data still waiting for its block is read from memory,
+			// and holes read as zeros
+			frame = dbuf_get(inode_id, position/BLOCK_SIZE, FALSE);
+			if (frame == NULL){
+				memset(b, '\0', BLOCK_SIZE);
+				frame = b;
+			}
+		} else if (b_read(inode_id, position/BLOCK_SIZE, b) == -1){
+			return -1;
+		}
+		iov_copy(&cursor, &frame[position%BLOCK_SIZE], toread, FALSE);
+
+		readed += toread;
+		position += toread;
+	}
+	return readed;
+}
+
+/*
+ * @brief 	Writes the segments of 'iov' into an inode starting at 'position', growing
+ *          the file if they go past its end. Each block is read and written once
+ *          whatever the number of segments it spans
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int file_writev(int inode_id, fs_iovec_t *iov, int iovcnt, int position) {
+	int numBytes = iov_total(iov, iovcnt);
+	int writed = 0, towrite = 0;
+	iov_cursor_t cursor = { iov, 0, 0 };
+	char b[BLOCK_SIZE];
+
+	if (numBytes == -1){ return -1; }
+	if (numBytes == 0 || position == MAX_FILE_SIZE){ return 0; }
+	if (numBytes > (MAX_FILE_SIZE - position)){
+		numBytes = MAX_FILE_SIZE - position;
+	}
+
+	while (writed < numBytes){
+		// Write up to the end of the current block
+		towrite = BLOCK_SIZE - position%BLOCK_SIZE;
+		if (towrite > numBytes - writed){
+			towrite = numBytes - writed;
+		}
+
+		int block_id = inodes[inode_id].inode.direct_block[position/BLOCK_SIZE];
+		if (block_id == -1){
+			// The block is not allocated yet: keep the data in memory
+			// until it is flushed, and allocate it then
+			char *frame = dbuf_get(inode_id, position/BLOCK_SIZE, TRUE);
+			if (frame == NULL){ break; }
+			iov_copy(&cursor, &frame[position%BLOCK_SIZE], towrite, TRUE);
+		} else {
+			if (b_read(inode_id, position/BLOCK_SIZE, b) == -1){return -1;};
+			// A block shared with clones is copied before it changes
+			if (superblock.block_refs[block_id] > 0){
+				block_id = b_unshare(inode_id, position/BLOCK_SIZE);
+				if (block_id == -1){ break; }
+			}
+			iov_copy(&cursor, &b[position%BLOCK_SIZE], towrite, TRUE);
+			if (bwrite(DEVICE_IMAGE, firstDataBlock + block_id, b) == -1){return -1;};
+			bcache_forget(block_id);
+			bitmap_setbit(inodes[inode_id].inode.unwritten, position/BLOCK_SIZE, 0);
+		}
+
+		writed += towrite;
+		position += towrite;
+	}
+	if (writed == 0){ return -1; }
+	return writed;
+}
+
+/*
+ * @brief 	Makes an inode at least 'end' bytes long. Appending writes
+ *          go on from the new end unless some of them are in flight
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_grow(int inode_id, int end) {
+	if (end <= inodes[inode_id].inode.size){ return 0; }
+	inodes[inode_id].inode.size = end;
+
+	int done = inodes_x[inode_id].append_done;
+	if (atomic_compare_exchange_strong(&inodes_x[inode_id].append_end, &done, end)){
+		inodes_x[inode_id].append_done = end;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Reads into the segments of 'iov' through a descriptor, at its offset. Readers
+ *          sharing a descriptor claim their ranges with an atomic update of the offset
+ * @return 	Number of bytes read, -1 in case of error.
+ */
+int fd_readv(int fd, fs_iovec_t *iov, int iovcnt) {
+	pthread_rwlock_rdlock(&data_lock);
+	// Check that the descriptor is open and get the file it reaches
+	int inode_id = fd_inode(fd);
+	int readed = -1;
+	if (inode_id != -1){
+		// The size can't change while the lock is shared
+		int size = inodes[inode_id].inode.size;
+		int numBytes = iov_total(iov, iovcnt);
+		int start = atomic_load(&files_x[fd].offset), end;
+		do {
+			end = (start < size) ? start + ((numBytes < size - start) ? numBytes : size - start) : start;
+		} while (!atomic_compare_exchange_weak(&files_x[fd].offset, &start, end));
+		readed = file_readv(inode_id, iov, iovcnt, start);
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return readed;
+}
+
+/*
+ * @brief 	Writes the segments of 'iov' through a descriptor, at its offset or,
+ *          if it was opened with FS_O_APPEND, at the end of the file
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int fd_writev(int fd, fs_iovec_t *iov, int iovcnt) {
+	// Descriptors are opened under the lock, their flags are read under it
+	pthread_rwlock_rdlock(&data_lock);
+	int append = (fd_inode(fd) != -1 && (files_x[fd].flags & FS_O_APPEND));
+	pthread_rwlock_unlock(&data_lock);
+	if (append){
+		return fd_append(fd, iov, iovcnt);
+	}
+
+	pthread_rwlock_wrlock(&data_lock);
+	// Check that the descriptor is open and get the file it reaches
+	int inode_id = fd_inode(fd);
+	int writed = -1;
+	if (inode_id != -1){
+		writed = file_writev(inode_id, iov, iovcnt, files_x[fd].offset);
+	}
+	// Update offset and size
+	if (writed > 0){
+		files_x[fd].offset += writed;
+		file_grow(inode_id, files_x[fd].offset);
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	return writed;
+}
+
+/*
+ * @brief 	Appends the segments of 'iov' through a descriptor. The range is reserved
+ *          with an atomic update of the end of the file, so appenders never wait for
+ *          each other to know where to write, and the size grows in reservation order
+ * @return 	Number of bytes written, -1 in case of error.
+ */
+int fd_append(int fd, fs_iovec_t *iov, int iovcnt) {
+	// The file can't be removed while the lock is shared,
+	// so the range is reserved in the inode the descriptor reaches
+	pthread_rwlock_rdlock(&data_lock);
+	int inode_id = fd_inode(fd);
+	if (inode_id == -1){
+		pthread_rwlock_unlock(&data_lock);
+		return -1;
+	}
+	int generation = inodes_x[inode_id].generation;
+
+	// Take the next range of the file
+	int numBytes = iov_total(iov, iovcnt);
+	int start = atomic_load(&inodes_x[inode_id].append_end), end;
+	do {
+		end = (start + numBytes < MAX_FILE_SIZE) ? start + numBytes : MAX_FILE_SIZE;
+	} while (!atomic_compare_exchange_weak(&inodes_x[inode_id].append_end, &start, end));
+	pthread_rwlock_unlock(&data_lock);
+	if (start == end){ return 0; }
+
+	pthread_rwlock_wrlock(&data_lock);
+	int writed = -1;
+	if (inodes_x[inode_id].generation == generation){
+		writed = file_writev(inode_id, iov, iovcnt, start);
+	}
+	if (writed > 0 && fd_inode(fd) == inode_id){
+		files_x[fd].offset = start + writed;
+	}
+	pthread_rwlock_unlock(&data_lock);
+
+	// Even a failed write makes its range visible, as a hole,
+	// or the appenders after it would wait forever
+	append_publish(inode_id, generation, start, end);
+	return writed;
+}
+
+/*
+ * @brief 	Waits until the appended bytes before 'start' are in the size,
+ *          then adds the range up to 'end'
+ * @return 	0 if success, -1 if the file was removed.
+ */
+int append_publish(int inode_id, int generation, int start, int end) {
+	int err = -1;
+
+	pthread_mutex_lock(&append_lock);
+	for (;;){
+		pthread_rwlock_wrlock(&data_lock);
+		if (inodes_x[inode_id].generation != generation){
+			pthread_rwlock_unlock(&data_lock);
+			break;
+		}
+		if (inodes_x[inode_id].append_done == start){
+			inodes_x[inode_id].append_done = end;
+			if (end > inodes[inode_id].inode.size){
+				inodes[inode_id].inode.size = end;
+			}
+			pthread_rwlock_unlock(&data_lock);
+			err = 0;
+			break;
+		}
+		pthread_rwlock_unlock(&data_lock);
+		pthread_cond_wait(&append_cond, &append_lock);
+	}
+	pthread_cond_broadcast(&append_cond);
+	pthread_mutex_unlock(&append_lock);
+
+	return err;
+}
+
+/*
+ * @brief 	Allocates the holes of a range of an inode, growing the file
+ *          unless FS_FALLOC_KEEP_SIZE is set
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_fallocate(int inode_id, int offset, int len, int flags) {
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+	int first = offset/BLOCK_SIZE, last = (offset + len - 1)/BLOCK_SIZE;
+
+	// Check that the whole range fits before taking anything. Blocks
+	// with delayed data already hold a reservation of their own
+	int needed = 0, reserved = 0;
+	for (int block = first; block <= last; block++){
+		if (direct_block[block] == -1){
+			needed++;
+			if (dbuf_get(inode_id, block, FALSE) != NULL){ reserved++; }
+		}
+	}
+	if (block_map_x.nfree - block_map_x.nreserved + reserved < needed) {return -1;}
+
+	// Delayed data gets its blocks first, so the range is laid out after it
+	if (reserved > 0 && dbuf_flush(inode_id) == -1) {return -1;}
+
+	// Allocate each hole of the range as one run
+	for (int block = first; block <= last; block++){
+		if (direct_block[block] != -1){ continue; }
+		int run = 1;
+		while (block + run <= last && direct_block[block + run] == -1){ run++; }
+		if (b_alloc(inode_id, block, run) == -1) {return -1;}
+		block += run - 1;
+	}
+
+	if (!(flags & FS_FALLOC_KEEP_SIZE)){
+		file_grow(inode_id, offset + len);
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Pins the slices of 'len' bytes of an inode starting at 'position' in the
+ *          block cache, one view per block. Holes view a block of zeros
+ * @return 	Number of views stored, -1 in case of error.
+ */
+int file_view(int inode_id, int position, int len, fs_view_t *views, int max) {
+	int size = inodes[inode_id].inode.size;
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+
+	if (len == 0 || position >= size){ return 0; }
+	if (len > size - position){
+		len = size - position;
+	}
+
+	// All the views must fit before pinning anything
+	int first = position/BLOCK_SIZE, last = (position + len - 1)/BLOCK_SIZE;
+	if (last - first + 1 > max){ return -1; }
+
+	// Delayed data is written first, so every view comes from a disk block
+	for (int block = first; block <= last; block++){
+		if (direct_block[block] == -1 && dbuf_get(inode_id, block, FALSE) != NULL){
+			if (dbuf_flush(inode_id) == -1){ return -1; }
+			break;
+		}
+	}
+
+	int count = 0;
+	while (len > 0){
+		int block = position/BLOCK_SIZE, toview = BLOCK_SIZE - position%BLOCK_SIZE;
+		if (toview > len){
+			toview = len;
+		}
+
+		char *frame = zero_block_x;
+		if (direct_block[block] != -1 && !bitmap_getbit(inodes[inode_id].inode.unwritten, block)){
+			frame = bcache_pin(direct_block[block]);
+			if (frame == NULL){
+				// Give back what was pinned so far
+				for (int i = 0; i < count; i++){
+					bcache_unpin(views[i].base);
+				}
+				return -1;
+			}
+		}
+		views[count].base = &frame[position%BLOCK_SIZE];
+		views[count].len = toview;
+		count++;
+
+		len -= toview;
+		position += toview;
+	}
+	return count;
+}
+
+/*
+ * @brief 	Gets a data block into the block cache and pins it
+ * @return 	Frame holding the block, NULL if every frame is pinned or in case of error.
+ */
+char *bcache_pin(int block_id) {
+	int frame = -1;
+
+	for (int i = 0; i < MAX_CACHED_BLOCKS; i++){
+		if (bcache_x[i].block == block_id){
+			bcache_x[i].pins++;
+			return bcache_x[i].data;
+		}
+	}
+
+	// Take the next unpinned frame under the hand
+	for (int i = 0; i < MAX_CACHED_BLOCKS && frame == -1; i++){
+		int candidate = (bcache_hand + i) % MAX_CACHED_BLOCKS;
+		if (bcache_x[candidate].pins == 0){ frame = candidate; }
+	}
+	if (frame == -1){ return NULL; }
+	bcache_hand = (frame + 1) % MAX_CACHED_BLOCKS;
+
+	bcache_x[frame].block = -1;
+	if (bread(DEVICE_IMAGE, firstDataBlock + block_id, bcache_x[frame].data) == -1){ return NULL; }
+	bcache_x[frame].block = block_id;
+	bcache_x[frame].pins = 1;
+	return bcache_x[frame].data;
+}
+
+/*
+ * @brief 	Unpins the cache frame a view points into. Views of the zero block are ignored
+ * @return 	0 if success, -1 otherwise.
+ */
+int bcache_unpin(const void *view) {
+	for (int i = 0; i < MAX_CACHED_BLOCKS; i++){
+		const char *data = bcache_x[i].data;
+		if ((const char *)view < data || (const char *)view >= data + BLOCK_SIZE){ continue; }
+
+		if (bcache_x[i].pins == 0){ return -1; }
+		bcache_x[i].pins--;
+		if (bcache_x[i].pins == 0 && bcache_x[i].block == -2){
+			bcache_x[i].block = -1;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Drops a data block from the block cache after it changed or was freed.
+ *          A pinned frame keeps the old contents for its views
+ * @return 	0 if success, -1 otherwise.
+ */
+int bcache_forget(int block_id) {
+	for (int i = 0; i < MAX_CACHED_BLOCKS; i++){
+		if (bcache_x[i].block == block_id){
+			bcache_x[i].block = bcache_x[i].pins > 0 ? -2 : -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Maps 'len' bytes of an inode starting at 'position' into anonymous
+ *          memory, filled at once so later accesses never call the file system
+ * @return 	Address of the mapping, NULL in case of error.
+ */
+void *map_create(int inode_id, int position, int len, int prot) {
+	int map = -1;
+	for (int i = 0; i < MAX_MAPS && map == -1; i++){
+		if (maps_x[i].addr == NULL){ map = i; }
+	}
+	if (map == -1){ return NULL; }
+
+	char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED){ return NULL; }
+
+	// Bytes past the end of the file stay zero
+	fs_iovec_t iov = { addr, len };
+	if (file_readv(inode_id, &iov, 1, position) == -1){
+		munmap(addr, len);
+		return NULL;
+	}
+
+	char *synced = NULL;
+	if (prot & FS_PROT_WRITE){
+		// Changes are found by comparing with the contents at the last sync
+		synced = malloc(len);
+		if (synced == NULL){
+			munmap(addr, len);
+			return NULL;
+		}
+		memcpy(synced, addr, len);
+	} else if (mprotect(addr, len, PROT_READ) == -1){
+		munmap(addr, len);
+		return NULL;
+	}
+
+	maps_x[map].addr = addr;
+	maps_x[map].synced = synced;
+	maps_x[map].len = len;
+	maps_x[map].offset = position;
+	maps_x[map].inode = inode_id;
+	maps_x[map].generation = inodes_x[inode_id].generation;
+	return addr;
+}
+
+/*
+ * @brief 	Gives the mapping starting at 'addr'
+ * @return 	map id if success, -1 otherwise.
+ */
+int map_find(void *addr) {
+	if (addr == NULL){ return -1; }
+	for (int i = 0; i < MAX_MAPS; i++){
+		if (maps_x[i].addr == addr){ return i; }
+	}
+	return -1;
+}
+
+/*
+ * @brief 	Writes back the blocks of a mapping that changed since the last sync.
+ *          Bytes past the end of the file are not written
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_writeback(int map) {
+	// Read-only mappings have nothing to write, nor do mappings of removed files
+	if (maps_x[map].synced == NULL){ return 0; }
+	int inode_id = maps_x[map].inode;
+	if (inodes_x[inode_id].generation != maps_x[map].generation){ return 0; }
+
+	int end = maps_x[map].offset + maps_x[map].len;
+	if (end > inodes[inode_id].inode.size){
+		end = inodes[inode_id].inode.size;
+	}
+
+	for (int position = maps_x[map].offset; position < end; ){
+		int towrite = BLOCK_SIZE - position%BLOCK_SIZE;
+		if (towrite > end - position){
+			towrite = end - position;
+		}
+
+		int i = position - maps_x[map].offset;
+		if (memcmp(&maps_x[map].addr[i], &maps_x[map].synced[i], towrite) != 0){
+			fs_iovec_t iov = { &maps_x[map].addr[i], towrite };
+			if (file_writev(inode_id, &iov, 1, position) != towrite){ return -1; }
+			memcpy(&maps_x[map].synced[i], &maps_x[map].addr[i], towrite);
+		}
+		position += towrite;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Writes back all the mappings of an inode
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_sync(int inode_id) {
+	for (int i = 0; i < MAX_MAPS; i++){
+		if (maps_x[i].addr != NULL && maps_x[i].inode == inode_id && map_writeback(i) == -1){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Writes back a mapping and frees it
+ * @return 	0 if success, -1 otherwise.
+ */
+int map_release(int map) {
+	if (map_writeback(map) == -1){ return -1; }
+
+	munmap(maps_x[map].addr, maps_x[map].len);
+	free(maps_x[map].synced);
+	maps_x[map].addr = NULL;
+	maps_x[map].synced = NULL;
+	return 0;
+}
+
+/*
+ * @brief 	Creates a file at 'path' with the contents of an inode, sharing its blocks
+ * @return 	inode id of the new file if success, -1 if it exists, -2 in case of error.
+ */
+int file_clone(int src, char *path) {
+	unsigned int *direct_block = inodes[src].inode.direct_block;
+
+	// Delayed data is given its blocks first, so all of it can be shared
+	if (dbuf_flush(src) == -1){ return -2; }
+	for (int i = 0; i < 5; i++){
+		if (direct_block[i] != -1 && superblock.block_refs[direct_block[i]] == MAX_BLOCK_REFS){ return -2; }
+	}
+
+	int dst = i_create(path, INODE);
+	if (dst < 0){ return dst; }
+
+	for (int i = 0; i < 5; i++){
+		inodes[dst].inode.direct_block[i] = direct_block[i];
+		if (direct_block[i] != -1){
+			superblock.block_refs[direct_block[i]]++;
+		}
+	}
+	memcpy(inodes[dst].inode.crc, inodes[src].inode.crc, sizeof(inodes[src].inode.crc));
+	memcpy(inodes[dst].inode.unwritten, inodes[src].inode.unwritten, sizeof(inodes[src].inode.unwritten));
+	file_grow(dst, inodes[src].inode.size);
+	return dst;
+}
+
+/*
+ * @brief 	Releases blocks 'first' to 'last' of an inode, freeing each run of
+ *          consecutive disk blocks at once, and the delayed data among them
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_release(int inode_id, int first, int last) {
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+
+	dbuf_discard(inode_id, first, last);
+	for (int block = first; block <= last; block++){
+		if (direct_block[block] == -1){ continue; }
+
+		int run = 1;
+		while (block + run <= last && direct_block[block + run] == direct_block[block] + run){ run++; }
+		if (bfree_run(direct_block[block], run) == -1){ return -1; }
+		for (int k = block; k < block + run; k++){
+			direct_block[k] = -1;
+			bitmap_setbit(inodes[inode_id].inode.unwritten, k, 0);
+		}
+		block += run - 1;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Zeroes the bytes of an inode from 'start' to 'end', both in the same block
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_zero(int inode_id, int start, int end) {
+	int block = start/BLOCK_SIZE;
+	int block_id = inodes[inode_id].inode.direct_block[block];
+	char b[BLOCK_SIZE];
+
+	if (start >= end){ return 0; }
+
+	// Holes and unwritten blocks already read as zeros
+	if (block_id == -1){
+		char *frame = dbuf_get(inode_id, block, FALSE);
+		if (frame != NULL){
+			memset(&frame[start%BLOCK_SIZE], '\0', end - start);
+		}
+		return 0;
+	}
+	if (bitmap_getbit(inodes[inode_id].inode.unwritten, block)){ return 0; }
+
+	if (b_read(inode_id, block, b) == -1){ return -1; }
+	if (superblock.block_refs[block_id] > 0){
+		block_id = b_unshare(inode_id, block);
+		if (block_id == -1){ return -1; }
+	}
+	memset(&b[start%BLOCK_SIZE], '\0', end - start);
+	if (bwrite(DEVICE_IMAGE, firstDataBlock + block_id, b) == -1){ return -1; }
+	bitmap_setbit(inodes[inode_id].inode.unwritten, block, 0);
+	bcache_forget(block_id);
+	return 0;
+}
+
+/*
+ * @brief 	Zeroes 'len' bytes of an inode from 'offset', releasing
+ *          the blocks fully inside the range
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_punch(int inode_id, int offset, int len) {
+	int end = offset + len;
+	int first = (offset + BLOCK_SIZE - 1)/BLOCK_SIZE, last = end/BLOCK_SIZE - 1;
+
+	// Range inside one block
+	if (first > last + 1){
+		return file_zero(inode_id, offset, end);
+	}
+
+	// Partial blocks at both ends, and whole blocks in between
+	if (file_zero(inode_id, offset, first*BLOCK_SIZE) == -1){ return -1; }
+	if (end < MAX_FILE_SIZE && file_zero(inode_id, (last + 1)*BLOCK_SIZE, end) == -1){ return -1; }
+	if (first <= last && file_release(inode_id, first, last) == -1){ return -1; }
+	return 0;
+}
+
+/*
+ * @brief 	Sets the size of an inode. Growing leaves a hole; shrinking releases
+ *          the blocks past the new end and zeroes the rest of the last one
+ * @return 	0 if success, -1 otherwise.
+ */
+int file_truncate(int inode_id, int len) {
+	int size = inodes[inode_id].inode.size;
+
+	if (len > size){
+		return file_grow(inode_id, len);
+	}
+
+	if (len < size){
+		int first = (len + BLOCK_SIZE - 1)/BLOCK_SIZE;
+		if (len%BLOCK_SIZE != 0 && file_zero(inode_id, len, (first)*BLOCK_SIZE) == -1){ return -1; }
+		if (first < 5 && file_release(inode_id, first, 4) == -1){ return -1; }
+		inodes[inode_id].inode.size = len;
+	}
+
+	// Appends go on from the new end
+	inodes_x[inode_id].append_done = len;
+	atomic_store(&inodes_x[inode_id].append_end, len);
+	return 0;
+}
+
+/*
+ * @brief 	Gives the datablock where the file with offset is, without allocating it
+ * @return 	block id if success, -1 if there is none.
+ */
+int b_lookup(int inode_id, int offset) {
+
+	// Check that the inode_id and offset are legal
+	if (inode_id < 0 || inode_id >= MAX_FILE_NUM) {return -1;}
+	if (offset < 0 || offset >= MAX_FILE_SIZE) {return -1;}
+
+	return inodes[inode_id].inode.direct_block[offset/BLOCK_SIZE];
+}
+
+/*
+ * @brief 	Reads block 'block' of an inode. Unwritten blocks read as zeros
+ *          without touching the disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int b_read(int inode_id, int block, char *buffer) {
+	int block_id = inodes[inode_id].inode.direct_block[block];
+	if (block_id == -1){ return -1; }
+
+	if (bitmap_getbit(inodes[inode_id].inode.unwritten, block)){
+		memset(buffer, '\0', BLOCK_SIZE);
+		return 0;
+	}
+	return bread(DEVICE_IMAGE, firstDataBlock + block_id, buffer);
+}
+
+/*
+ * @brief 	Gives block 'block' of an inode a disk block of its own, instead of one
+ *          shared with clones. The new block is unwritten: the caller writes it
+ * @return 	id of the new block if success, -1 otherwise.
+ */
+int b_unshare(int inode_id, int block) {
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+	int old = direct_block[block];
+
+	// Blocks promised to delayed data can't be taken
+	if (block_map_x.nfree - block_map_x.nreserved < 1){ return -1; }
+
+	direct_block[block] = -1;
+	if (b_alloc(inode_id, block, 1) == -1){
+		direct_block[block] = old;
+		return -1;
+	}
+	superblock.block_refs[old]--;
+	return direct_block[block];
+}
+
+/*
+ * @brief 	Allocates disk blocks for 'count' unallocated blocks of an inode starting
+ *          at block 'first', contiguously after the previous block of the file
+ * @return 	0 if success, -1 otherwise.
+ */
+int b_alloc(int inode_id, int first, int count) {
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+
+	int goal = block_map_x.rotor;
+	if (first > 0 && direct_block[first-1] != -1){ goal = direct_block[first-1] + 1; }
+
+	for (int done = 0; done < count; ){
+		int len, block_id = balloc_range(goal, 1, count - done, &len);
+		if (block_id == -1){
+			// Give back what was taken so far
+			for (int k = 0; k < done; k++){
+				bfree(direct_block[first + k]);
+				direct_block[first + k] = -1;
+			}
+			return -1;
+		}
+		for (int k = 0; k < len; k++){
+			direct_block[first + done + k] = block_id + k;
+			bitmap_setbit(inodes[inode_id].inode.unwritten, first + done + k, 1);
+		}
+		done += len;
+		goal = block_id + len;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Gives the delayed buffer holding block 'block' of an inode. If there is none
+ *          and 'create' is TRUE, a zeroed buffer is set up and a disk block reserved for it.
+ * @return 	Buffer data if success, NULL otherwise.
+ */
+char *dbuf_get(int inode_id, int block, int create) {
+	int free_buf = -1;
+
+	for (int i = 0; i < MAX_DIRTY_BUFFERS; i++){
+		if (dirty_x[i].inode == inode_id && dirty_x[i].block == block){
+			return dirty_x[i].data;
+		}
+		if (dirty_x[i].inode == -1 && free_buf == -1){ free_buf = i; }
+	}
+	if (!create){ return NULL; }
+
+	// Promise a disk block for the flush, so it can't run out of space
+	if (block_map_x.nfree - block_map_x.nreserved < 1){ return NULL; }
+
+	// If the pool is full write back the file owning the next
+	// buffer under the hand, which frees all of its buffers
+	if (free_buf == -1){
+		free_buf = dirty_hand;
+		dirty_hand = (dirty_hand + 1) % MAX_DIRTY_BUFFERS;
+		if (dbuf_flush(dirty_x[free_buf].inode) == -1){ return NULL; }
+	}
+
+	block_map_x.nreserved++;
+	dirty_x[free_buf].inode = inode_id;
+	dirty_x[free_buf].block = block;
+	memset(dirty_x[free_buf].data, '\0', BLOCK_SIZE);
+	return dirty_x[free_buf].data;
+}
+
+/*
+ * @brief 	Allocates disk blocks for the delayed buffers of an inode (-1 for all inodes)
+ *          and writes them to disk
+ * @return 	0 if success, -1 otherwise.
+ */
+int dbuf_flush(int inode_id) {
+	if (inode_id == -1){
+		for (int i = 0; i < MAX_DIRTY_BUFFERS; i++){
+			if (dirty_x[i].inode != -1 && dbuf_flush(dirty_x[i].inode) == -1){ return -1; }
+		}
+		return 0;
+	}
+
+	// Buffers of the inode by block index
+	int bufs[5] = {-1, -1, -1, -1, -1};
+	for (int i = 0; i < MAX_DIRTY_BUFFERS; i++){
+		if (dirty_x[i].inode == inode_id){ bufs[dirty_x[i].block] = i; }
+	}
+
+	unsigned int *direct_block = inodes[inode_id].inode.direct_block;
+	for (int block = 0; block < 5; block++){
+		if (bufs[block] == -1){ continue; }
+
+		if (direct_block[block] == -1){
+			// Allocate the whole run of consecutive buffered blocks at once
+			int run = 1;
+			while (block + run < 5 && bufs[block + run] != -1 && direct_block[block + run] == -1){ run++; }
+
+			block_map_x.nreserved -= run;
+			if (b_alloc(inode_id, block, run) == -1){
+				block_map_x.nreserved += run;
+				return -1;
+			}
+		}
+
+		if (bwrite(DEVICE_IMAGE, firstDataBlock + direct_block[block], dirty_x[bufs[block]].data) == -1){ return -1; }
+		bitmap_setbit(inodes[inode_id].inode.unwritten, block, 0);
+		dirty_x[bufs[block]].inode = -1;
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Discards the delayed buffers of blocks 'first' to 'last' of an inode
+ *          without writing them
+ * @return 	0 if success, -1 otherwise.
+ */
+int dbuf_discard(int inode_id, int first, int last) {
+	for (int i = 0; i < MAX_DIRTY_BUFFERS; i++){
+		if (dirty_x[i].inode == inode_id && dirty_x[i].block >= first && dirty_x[i].block <= last){
+			dirty_x[i].inode = -1;
+			if (inodes[inode_id].inode.direct_block[dirty_x[i].block] == -1){
+				block_map_x.nreserved--;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief 	Read metadata from disk to memory
+ * @return 	0 if success, -1 otherwise.
+ */
+int meta_readFromDisk(void){
+
+	char b[BLOCK_SIZE];
+
+	// Read the superblock from disk to memory
+	if (bread(DEVICE_IMAGE, SuperBlock_Block, b) == -1){return -1;}
+	memcpy((char*)&superblock, b, BLOCK_SIZE);
+
+	// Images with another layout would be read as garbage
+	if (superblock.magic_num != MAGIC_NUM){return -1;}
+
+	// Take the free counts saved in the superblock, counting
+	// the bitmaps only if they are out of range
+	if (superblock.free_inodes > MAX_FILE_NUM){
+		superblock.free_inodes = MAX_FILE_NUM - bitmap_count(superblock.inode_map, MAX_FILE_NUM);
+	}
+	if (superblock.free_blocks > data_block_num()){
+		superblock.free_blocks = data_block_num() - bitmap_count(superblock.block_map, data_block_num());
+	}
+	bitmap_x_init(&inode_map_x, superblock.free_inodes);
+	bitmap_x_init(&block_map_x, superblock.free_blocks);
 
 	// Read the frist 24 inodes from disk to memory
 	if (bread(DEVICE_IMAGE, firstInodes_Block, b) == -1){return -1;}
@@ -707,7 +2309,9 @@ int meta_readFromDisk(void){
  */
 int meta_writeToDisk(void){
 
-	// write in disk the superblock
+	// write in disk the superblock, with the current free counts
+	superblock.free_inodes = inode_map_x.nfree;
+	superblock.free_blocks = block_map_x.nfree;
 	char buff[BLOCK_SIZE];
 	memset(buff, '\0', BLOCK_SIZE);
 	memmove(buff, (char*) &superblock, sizeof(superblock));
@@ -16,6 +16,10 @@
 #ifndef _USER_H_
 #define _USER_H_
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include "filesystem/blocks_cache.h" // Headers for block managing (read/write)
 #include "filesystem/crc.h"
 
@@ -24,11 +28,66 @@
 #define FS_SEEK_CUR 0
 #define FS_SEEK_END 1
 #define FS_SEEK_BEGIN 2
+#define FS_FALLOC_KEEP_SIZE 1  // fallocateFile: do not change the file size
+#define FS_O_APPEND 1          // openFileFlags: every write goes to the end of the file
+
+#define FS_TYPE_FILE 0  // Types of the entries given by listFiles
+#define FS_TYPE_LINK 1
+#define FS_TYPE_DIR  2
+#define FS_NAME_SIZE 32 // Longest name of a path component, with its ending '\0'
+
+/* Entry of the file system, as given by listFiles */
+typedef struct {
+  int inode_id;               /* Inode of the entry */
+  int type;                   /* FS_TYPE_FILE, FS_TYPE_LINK or FS_TYPE_DIR */
+  char name[FS_NAME_SIZE];    /* Last component of its path */
+  int parent;                 /* Inode of the directory holding it */
+  unsigned int size;          /* Bytes for files, entries for directories */
+  unsigned int blocks;        /* Data blocks in use, counting the ones not yet allocated */
+} fs_entry_t;
+
+/* Segment of a buffer, for readFilev and writeFilev */
+typedef struct {
+  void *base;                 /* First byte of the segment */
+  int len;                    /* Bytes in the segment */
+} fs_iovec_t;
+
+#define FS_PROT_READ  1  // mmapFile: the mapping can be read
+#define FS_PROT_WRITE 2  // mmapFile: the mapping can be written, and written back
+#define FS_MAX_VIEWS (MAX_FILE_SIZE/BLOCK_SIZE) // Most views readFileView can give
+
+/* Read-only slice of a file, as given by readFileView */
+typedef struct {
+  const void *base;           /* First byte of the slice */
+  int len;                    /* Bytes in the slice */
+} fs_view_t;
+
+#define FS_AIO_DEPTH 64   // Asynchronous requests in flight at the same time
+
+/* Completion of an asynchronous request, as given by aio_pollFile */
+typedef struct {
+  void *user_data;            /* Given at submission */
+  int result;                 /* Bytes read or written, -1 in case of error */
+} fs_aio_event_t;
+
+/* Called by a worker thread when an asynchronous request completes. The request
+   no longer counts as in flight, so the callback may use the whole API */
+typedef void (*fs_aio_callback_t)(void *user_data, int result);
+
+/* File system usage, as given by statFS */
+typedef struct {
+  unsigned int block_size;    /* Bytes per block */
+  unsigned int total_blocks;  /* Data blocks in the device */
+  unsigned int free_blocks;   /* Data blocks still available */
+  unsigned int total_inodes;  /* Maximum number of files */
+  unsigned int free_inodes;   /* Inodes still available */
+} fs_stat_t;
 
 
 
 /*
  * @brief 	Generates the proper file system structure in a storage device, as designed by the student.
+ *          Fails while a file system is mounted.
  * @return 	0 if success, -1 otherwise.
  */
 int mkFS(long deviceSize);
@@ -44,6 +103,20 @@ int mountFS(void);
  */
 int unmountFS(void);
 
+/*
+ * @brief	Gives the size and free space of the file system, without scanning it.
+ * @return	0 if success, -1 otherwise.
+ */
+int statFS(fs_stat_t *stat);
+
+/*
+ * @brief	Lists up to 'max' files, links and directories, starting at 'cursor',
+ *          which is updated to continue with the next call. Start with cursor 0.
+ *          The root directory has no name nor parent and is not listed.
+ * @return	Number of entries stored (0 when there are no more), -1 in case of error.
+ */
+int listFiles(int *cursor, fs_entry_t *entries, int max);
+
 /*
  * @brief	Creates a new file, provided it it doesn't exist in the file system.
  * @return	0 if success, -1 if the file already exists, -2 in case of error.
@@ -62,6 +135,15 @@ int removeFile(char *path);
  */
 int openFile(char *path);
 
+/*
+ * @brief	Opens an existing file with the FS_O_* flags given. With FS_O_APPEND, writeFile
+ *          and writeFilev write at the end of the file, even from several threads at
+ *          once: each write takes its own range, and the size grows in the order the
+ *          ranges were taken. A failed append leaves its range as a hole.
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
+ */
+int openFileFlags(char *path, int flags);
+
 /*
  * @brief	Closes a file.
  * @return	0 if success, -1 otherwise.
@@ -80,12 +162,119 @@ int readFile(int fileDescriptor, void *buffer, int numBytes);
  */
 int writeFile(int fileDescriptor, void *buffer, int numBytes);
 
+/*
+ * @brief	Reads a number of bytes from a file at a given position, without using
+ *          or changing the offset of the descriptor. Safe to call from several threads.
+ * @return	Number of bytes properly read, -1 in case of error.
+ */
+int readFileAt(int fileDescriptor, void *buffer, int numBytes, long offset);
+
+/*
+ * @brief	Writes a number of bytes into a file at a given position, without using
+ *          or changing the offset of the descriptor. Safe to call from several threads.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+int writeFileAt(int fileDescriptor, void *buffer, int numBytes, long offset);
+
+/*
+ * @brief	Reads from a file into the segments of 'iov', in order, as one readFile.
+ * @return	Number of bytes properly read, -1 in case of error.
+ */
+int readFilev(int fileDescriptor, fs_iovec_t *iov, int iovcnt);
+
+/*
+ * @brief	Writes the segments of 'iov' into a file, in order, as one writeFile.
+ * @return	Number of bytes properly written, -1 in case of error.
+ */
+int writeFilev(int fileDescriptor, fs_iovec_t *iov, int iovcnt);
+
+/*
+ * @brief	Gives the bytes of a range of a file as up to 'max' read-only slices of the
+ *          block cache, without copying them. FS_MAX_VIEWS slices are always enough.
+ *          They keep the contents of the range at the call until releaseFileView.
+ * @return	Number of views stored (0 at the end of the file), -1 in case of error.
+ */
+int readFileView(int fileDescriptor, long offset, int len, fs_view_t *views, int max);
+
+/*
+ * @brief	Gives back the views got from readFileView.
+ * @return	0 if success, -1 otherwise.
+ */
+int releaseFileView(fs_view_t *views, int count);
+
+/*
+ * @brief	Maps 'len' bytes of a file starting at 'offset' into memory, with the
+ *          FS_PROT_* access in prot. The mapping is filled with the file contents at
+ *          the call; changes are written back by msyncFile, munmapFile, closing the
+ *          file and unmountFS. Bytes past the end of the file read as zeros and are
+ *          not written back.
+ * @return	Address of the mapping, NULL in case of error.
+ */
+void *mmapFile(int fileDescriptor, long offset, int len, int prot);
+
+/*
+ * @brief	Writes back to its file what was changed in a mapping.
+ * @return	0 if success, -1 otherwise.
+ */
+int msyncFile(void *addr);
+
+/*
+ * @brief	Writes back a mapping and removes it.
+ * @return	0 if success, -1 otherwise.
+ */
+int munmapFile(void *addr);
+
+/*
+ * @brief	Starts reading from a file at a given position, as readFileAt, without waiting
+ *          for it. At completion 'callback' is called from a worker thread, or if it is
+ *          NULL the completion is queued for aio_pollFile. The buffer must stay valid
+ *          until then.
+ * @return	0 if the request was queued, -1 if FS_AIO_DEPTH requests are in flight or in case of error.
+ */
+int aio_readFile(int fileDescriptor, void *buffer, int numBytes, long offset,
+                 fs_aio_callback_t callback, void *user_data);
+
+/*
+ * @brief	Starts writing into a file at a given position, as writeFileAt, without
+ *          waiting for it. Completions are given as in aio_readFile.
+ * @return	0 if the request was queued, -1 if FS_AIO_DEPTH requests are in flight or in case of error.
+ */
+int aio_writeFile(int fileDescriptor, void *buffer, int numBytes, long offset,
+                  fs_aio_callback_t callback, void *user_data);
+
+/*
+ * @brief	Takes up to 'max' completions from the completion queue. If 'wait' is set and
+ *          the queue is empty, waits for one while requests are in flight.
+ * @return	Number of completions stored, -1 in case of error.
+ */
+int aio_pollFile(fs_aio_event_t *events, int max, int wait);
+
 /*
  * @brief	Modifies the position of the seek pointer of a file.
  * @return	0 if succes, -1 otherwise.
  */
 int lseekFile(int fileDescriptor, long offset, int whence);
 
+/*
+ * @brief	Reserves disk blocks for a range of a file, as contiguous as possible.
+ *          Unless FS_FALLOC_KEEP_SIZE is set in flags, the file grows to cover the range.
+ * @return	0 if success, -1 otherwise.
+ */
+int fallocateFile(int fileDescriptor, long offset, long len, int flags);
+
+/*
+ * @brief	Sets the size of a file. Growing it leaves a hole that reads as zeros;
+ *          shrinking it frees the blocks past the new end. Appends go on from it.
+ * @return	0 if success, -1 if appends are in flight or in case of error.
+ */
+int truncateFile(int fileDescriptor, long len);
+
+/*
+ * @brief	Zeroes 'len' bytes of a file from 'offset', freeing the blocks fully
+ *          inside the range. The size does not change.
+ * @return	0 if success, -1 otherwise.
+ */
+int punchHole(int fileDescriptor, long offset, long len);
 
 /*
  * @brief	Checks the integrity of the file.
@@ -119,6 +308,14 @@ int closeFileIntegrity(int fileDescriptor);
  */
 int createLn(char *fileName, char *linkName);
 
+/*
+ * @brief	Creates a new file with the contents of an existing one, sharing its data
+ *          blocks instead of copying them. A block is copied when either file
+ *          writes to it.
+ * @return	0 if success, -1 if the source file does not exist, -2 in case of error.
+ */
+int cloneFile(char *srcName, char *dstName);
+
 /*
  * @brief 	Deletes an existing symbolic link
  * @return 	0 if the file is correct, -1 if the symbolic link does not exist, -2 in case of error.
@@ -126,5 +323,21 @@ int createLn(char *fileName, char *linkName);
 int removeLn(char *linkName);
 
 
+/*
+ * @brief	Creates a new directory, provided it doesn't exist in the file system.
+ * @return	0 if success, -1 if the directory already exists, -2 in case of error.
+ */
+int mkDir(char *path);
+
+/*
+ * @brief	Deletes an empty directory.
+ * @return	0 if success, -1 if the directory does not exist, -2 in case of error.
+ */
+int rmDir(char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,298 @@
+
+/*
+ *
+ * Operating System Design / Diseño de Sistemas Operativos
+ * (c) ARCOS.INF.UC3M.ES
+ *
+ * @file 	fs_coro.hpp
+ * @brief 	Header-only C++20 coroutine interface over the asynchronous file API.
+ *          Needs -std=c++20 and libfs.a, nothing else.
+ * @date	Last revision 01/04/2020
+ *
+ */
+
+#ifndef _FS_CORO_HPP_
+#define _FS_CORO_HPP_
+
+#include "filesystem/filesystem.h" // Headers for the core functionality
+
+#include <climits>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace fsco {
+
+/*
+ * Open file that is closed when the handle goes away. It must outlive
+ * the operations started on it.
+ */
+class File {
+public:
+  File() noexcept = default;
+  explicit File(int fd) noexcept : fd_(fd) {}
+
+  /* Opens an existing file, invalid if openFile fails */
+  static File open(const char *path) noexcept {
+    return File(openFile(const_cast<char *>(path)));
+  }
+
+  File(File &&other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+  File &operator=(File &&other) noexcept {
+    if (this != &other) {
+      close();
+      fd_ = std::exchange(other.fd_, -1);
+    }
+    return *this;
+  }
+  File(const File &) = delete;
+  File &operator=(const File &) = delete;
+  ~File() { close(); }
+
+  int fd() const noexcept { return fd_; }
+  explicit operator bool() const noexcept { return fd_ >= 0; }
+
+  /* Closes the file now. 0 if success, -1 otherwise */
+  int close() noexcept {
+    if (fd_ < 0) return 0;
+    return closeFile(std::exchange(fd_, -1));
+  }
+
+private:
+  int fd_ = -1;
+};
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+/* State shared by the promises of every Task */
+struct PromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr error;
+
+  /* Resumes the awaiting coroutine once the task is over */
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation;
+    }
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+/* Task body common to every result type: owns the coroutine frame */
+template <typename Promise> class TaskBase {
+public:
+  TaskBase(TaskBase &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+  TaskBase &operator=(TaskBase &&other) noexcept {
+    if (this != &other) {
+      if (h_) h_.destroy();
+      h_ = std::exchange(other.h_, {});
+    }
+    return *this;
+  }
+  ~TaskBase() {
+    if (h_) h_.destroy();
+  }
+
+  bool await_ready() const noexcept { return !h_ || h_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+    h_.promise().continuation = caller;
+    return h_;
+  }
+
+protected:
+  explicit TaskBase(std::coroutine_handle<Promise> h) noexcept : h_(h) {}
+  std::coroutine_handle<Promise> h_;
+};
+
+/* Coroutine run by Executor::spawn, freed when it ends */
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() noexcept {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+  std::coroutine_handle<> h;
+};
+
+/* Promise of a Task giving a T */
+template <typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+  Task<T> get_return_object() noexcept;
+  void return_value(T v) { value.emplace(std::move(v)); }
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() const noexcept {}
+};
+
+} // namespace detail
+
+/*
+ * Lazy coroutine giving a T. It starts when awaited and resumes its
+ * awaiter when it ends, rethrowing what escaped from it.
+ */
+template <typename T> class Task : public detail::TaskBase<detail::Promise<T>> {
+public:
+  using promise_type = detail::Promise<T>;
+
+  T await_resume() {
+    if (this->h_.promise().error) std::rethrow_exception(this->h_.promise().error);
+    if constexpr (!std::is_void_v<T>) return std::move(*this->h_.promise().value);
+  }
+
+private:
+  friend promise_type;
+  explicit Task(std::coroutine_handle<promise_type> h) noexcept
+      : detail::TaskBase<promise_type>(h) {}
+};
+
+template <typename T> Task<T> detail::Promise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<Promise>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<Promise>::from_promise(*this));
+}
+
+class Executor;
+
+/*
+ * Read or write on a file, as an awaitable. The coroutine awaiting it
+ * is suspended until the request completes, and gets what readFileAt
+ * or writeFileAt would have returned.
+ */
+class IoOp {
+public:
+  bool await_ready() const noexcept { return false; }
+  inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+  int await_resume() const noexcept { return result_; }
+
+private:
+  friend class Executor;
+
+  IoOp(Executor *ex, bool write, int fd, void *data, std::size_t size, long offset) noexcept
+      : ex_(ex), write_(write), fd_(fd), data_(data),
+        size_(size > INT_MAX ? INT_MAX : static_cast<int>(size)), offset_(offset) {}
+
+  /* Hands the request to the aio workers. false if they can't take it now */
+  bool start() noexcept {
+    return write_ ? aio_writeFile(fd_, data_, size_, offset_, nullptr, this) == 0
+                  : aio_readFile(fd_, data_, size_, offset_, nullptr, this) == 0;
+  }
+
+  Executor *ex_;
+  bool write_;
+  int fd_;
+  void *data_;
+  int size_;
+  long offset_;
+  int result_ = -1;
+  std::coroutine_handle<> handle_;
+};
+
+/*
+ * Single-threaded executor. Coroutines run on the thread calling run(),
+ * and file operations are served by the aio workers meanwhile. It owns
+ * the aio completion queue while it runs: nothing else may poll it.
+ */
+class Executor {
+public:
+  Executor() = default;
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  /* Reads into 'buffer' from 'offset' */
+  IoOp read(const File &file, std::span<std::byte> buffer, long offset) noexcept {
+    return IoOp(this, false, file.fd(), buffer.data(), buffer.size(), offset);
+  }
+
+  /* Writes 'buffer' at 'offset' */
+  IoOp write(const File &file, std::span<const std::byte> buffer, long offset) noexcept {
+    return IoOp(this, true, file.fd(), const_cast<std::byte *>(buffer.data()), buffer.size(), offset);
+  }
+
+  /* Schedules a task, which runs inside run() */
+  void spawn(Task<void> task) { ready_.push_back(detach(std::move(task)).h); }
+
+  /* Runs the scheduled tasks until all of them are over */
+  void run() {
+    fs_aio_event_t events[FS_AIO_DEPTH];
+
+    for (;;) {
+      while (!ready_.empty()) {
+        std::coroutine_handle<> h = ready_.front();
+        ready_.pop_front();
+        h.resume();
+      }
+      if (inflight_ == 0) return;
+
+      int n = aio_pollFile(events, FS_AIO_DEPTH, 1);
+      if (n < 0) std::terminate();
+      for (int i = 0; i < n; i++) {
+        IoOp *op = static_cast<IoOp *>(events[i].user_data);
+        op->result_ = events[i].result;
+        inflight_--;
+        ready_.push_back(op->handle_);
+      }
+
+      // Completions made room for the requests that didn't fit
+      while (!waiting_.empty() && waiting_.front()->start()) {
+        waiting_.pop_front();
+        inflight_++;
+      }
+      // Nothing can make room any more: those requests fail
+      while (inflight_ == 0 && !waiting_.empty()) {
+        ready_.push_back(waiting_.front()->handle_);
+        waiting_.pop_front();
+      }
+    }
+  }
+
+private:
+  friend class IoOp;
+
+  static detail::Detached detach(Task<void> task) { co_await task; }
+
+  /* Starts an operation, or queues it while the aio queue is full.
+     false if it failed and the coroutine must go on at once */
+  bool submit(IoOp &op) noexcept {
+    if (waiting_.empty() && op.start()) {
+      inflight_++;
+      return true;
+    }
+    if (inflight_ == 0) return false;
+    waiting_.push_back(&op);
+    return true;
+  }
+
+  std::deque<std::coroutine_handle<>> ready_;  // Coroutines to resume
+  std::deque<IoOp *> waiting_;                 // Operations waiting for room in the aio queue
+  int inflight_ = 0;                           // Operations handed to the aio workers
+};
+
+inline bool IoOp::await_suspend(std::coroutine_handle<> h) noexcept {
+  handle_ = h;
+  return ex_->submit(*this);
+}
+
+} // namespace fsco
+
+#endif
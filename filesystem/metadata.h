@@ -9,14 +9,26 @@
  * @date	Last revision 01/04/2020
  *
  */
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 #define MAX_FILE_NUM 48
-#define MAX_NAME_LENGHT 32
+#define MAX_NAME_LENGHT FS_NAME_SIZE
 
 #define MIN_DISK_SIZE 460*1024
 #define MAX_DISK_SIZE 600*1024
 
 #define MAX_BLOCK_NUM 48*5
 
+#define NAME_BLOOM_SIZE 1024            // Counters of the name filter, power of two
+#define NAME_BLOOM_HASHES 3             // Counters touched by each name
+
+#define MAX_BLOCK_REFS 255              // Most owners besides the first a block can have
+
+#define MAGIC_NUM 383465                // Changes whenever the disk layout does, older images are refused
+
 /* Superblock type */
 typedef struct superblock {
   unsigned int magic_num;	                /* Magic number for checking integrity */
@@ -25,11 +37,16 @@ typedef struct superblock {
   unsigned int block_num;                 /* Number of blocks = size/2048 */
   char inode_map[MAX_FILE_NUM/8];         /* Map of inodes */
   char block_map[MAX_BLOCK_NUM/8];        /* Map of blocks */
-  char padding[BLOCK_SIZE-(4*sizeof(int))-(MAX_FILE_NUM/8)-(MAX_BLOCK_NUM/8)]; /* Padding (for filling the block) */
+  unsigned int free_inodes;               /* Free entries in inode_map */
+  unsigned int free_blocks;               /* Free entries in block_map */
+  unsigned char name_bloom[NAME_BLOOM_SIZE/2]; /* Counting Bloom filter of (directory, name), 4 bits per counter */
+  unsigned char block_refs[MAX_BLOCK_NUM];  /* Owners of each block besides the first, shared by cloneFile */
+  char padding[BLOCK_SIZE-(6*sizeof(int))-(MAX_FILE_NUM/8)-(MAX_BLOCK_NUM/8)-(NAME_BLOOM_SIZE/2)-MAX_BLOCK_NUM]; /* Padding (for filling the block) */
 } superblock_t;
 
-#define INODE 0
-#define LINK  1
+#define INODE     FS_TYPE_FILE
+#define LINK      FS_TYPE_LINK
+#define DIRECTORY FS_TYPE_DIR
 
 /* Disk inode type */
 typedef struct{
@@ -40,6 +57,7 @@ typedef struct{
       unsigned int size;	                     /* Current file size in bytes */
       unsigned int direct_block[5];            /* Number of the direct block */
       uint32_t crc[5];
+      char unwritten[1];                       /* Map of direct blocks allocated but never written */
     }inode;
     struct soft_link {
       char source[MAX_NAME_LENGHT];
@@ -48,13 +66,44 @@ typedef struct{
   };                        
 } inode_t;
 
-/* File descriptor table only in memory */
+/* Directory entry: directory blocks are arrays of them */
+typedef struct {
+  char name[MAX_NAME_LENGHT];                  /* Entry name, empty if the entry is free */
+  int inode_id;                                /* Inode of the entry */
+} dirent_t;
+
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE/sizeof(dirent_t))
+
+/* Directory block. Each name goes in the direct block given by dir_bucket() */
+typedef union {
+  dirent_t entries[DIRENTS_PER_BLOCK];
+  char data[BLOCK_SIZE];
+} dirblock_t;
+
+#define MAX_OPEN_FILES 64   // Descriptors open at the same time
+
+/* In-core inodes only in memory, shared by the descriptors of a file */
 struct {
-  int state;  /*open/close*/
-  int offset; /* read/write position*/
-  int integrity; /* true if it's open with integrity, false if not */
+  int generation; /* times this inode has been freed */
+  atomic_int append_end; /* end of the bytes reserved by appending writes */
+  int append_done;       /* end of the appended bytes already in the size */
 }inodes_x[MAX_FILE_NUM];
 
+/* Descriptor flags: the FS_O_* ones given at open, and these */
+#define FD_INTEGRITY 0x100 // Opened with integrity, closed with closeFileIntegrity
+
+/* Open file table only in memory, indexed by file descriptor. Entries are
+   opened and closed with data_lock held exclusively, and read with it held */
+struct {
+  int state;      /* open/close */
+  int inode;      /* file reached once links are followed at open */
+  int generation; /* generation of the inode at open */
+  atomic_int offset; /* read/write position, claimed atomically by parallel readers */
+  int flags;      /* FS_O_* and FD_* flags */
+}files_x[MAX_OPEN_FILES];
+
+#define MAX_LINK_DEPTH 8  // Longest chain of links followed
+
 /* Define states */
 #define OPEN  1
 #define CLOSE 0
@@ -62,17 +111,93 @@ struct {
 superblock_t superblock;                // superblock declaration
 inode_t inodes[MAX_FILE_NUM];           // First inodes block declaration
 
+_Static_assert(sizeof(superblock_t) == BLOCK_SIZE, "the superblock must fill its block");
+_Static_assert(24*sizeof(inode_t) <= BLOCK_SIZE, "24 inodes must fit in an inode block");
+
 #define FALSE 0
 #define TRUE  1
 
 int isMounted = FALSE;
 
+/* File data lock: readers share it, writers take it alone */
+pthread_rwlock_t data_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Appending writes wait here to make their bytes visible in order */
+pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t append_cond = PTHREAD_COND_INITIALIZER;
+
+/* Bitmap allocator state only in memory (free counts are saved in the superblock) */
+typedef struct {
+  int rotor;  /* Next-fit starting position */
+  int nfree;  /* Free entries left in the map */
+  int nreserved; /* Free entries promised to delayed allocations */
+} bitmap_x_t;
+
+bitmap_x_t inode_map_x;                 // inode_map allocator state
+bitmap_x_t block_map_x;                 // block_map allocator state
+
+#define NAME_HASH_SIZE 128               // Power of two, at least twice MAX_FILE_NUM
+
+/* Name index only in memory: open addressing table of inode ids keyed
+   by (parent directory, name), -1 if empty */
+int name_hash_x[NAME_HASH_SIZE];
+int parent_x[MAX_FILE_NUM];             // Directory holding each inode, only in memory
+char dir_loaded_x[MAX_FILE_NUM][1];     // Map of the blocks of each directory already in the name index
+
+#define PATH_CACHE_SIZE 64               // Power of two
+#define MAX_PATH_LENGHT 128              // Longer paths are not cached
+
+/* Path lookup cache only in memory, direct mapped by path hash */
+struct {
+  int valid;                      /* TRUE if the entry holds a lookup */
+  int inode_id;                   /* Inode of the path, -1 if it does not exist */
+  char path[MAX_PATH_LENGHT];     /* Path without empty components */
+}path_cache_x[PATH_CACHE_SIZE];
+
+#define MAX_DIRTY_BUFFERS 16
+
+/* Delayed-allocation buffers only in memory */
+struct {
+  int inode;              /* Owner inode, -1 if the buffer is free */
+  int block;              /* Block index inside the file */
+  char data[BLOCK_SIZE];  /* Contents waiting for a disk block */
+}dirty_x[MAX_DIRTY_BUFFERS];
+
+int dirty_hand = 0;                     // Next buffer to evict when the pool is full
+
+#define MAX_CACHED_BLOCKS 16
+
+/* Clean block cache only in memory, backing the views given by readFileView */
+struct {
+  int block;              /* Data block held, -1 if the frame is free, -2 if it is
+                             out of date and only kept for the views pinning it */
+  int pins;               /* Views pointing into the frame */
+  char data[BLOCK_SIZE];  /* Contents of the block */
+}bcache_x[MAX_CACHED_BLOCKS];
+
+int bcache_hand = 0;                    // Next frame to reuse when the cache is full
+char zero_block_x[BLOCK_SIZE];          // Always zeros, backs views of holes and unwritten blocks
+
+#define MAX_MAPS 16
+
+/* File mappings only in memory */
+struct {
+  char *addr;             /* Start of the mapping, NULL if the entry is free */
+  char *synced;           /* Contents at the last sync, NULL for read-only mappings */
+  int len;                /* Bytes mapped */
+  int offset;             /* Position in the file of the first byte mapped */
+  int inode;              /* File mapped */
+  int generation;         /* Generation of the inode when mapped */
+}maps_x[MAX_MAPS];
+
 // Structure of file system
 #define SuperBlock_Block       0    //First block for superblock
 #define firstInodes_Block      1    // First block for array of inodes
 #define secondInodes_Block     2    // Second block for array of inodes
 #define firstDataBlock         3    // Data blocks start at block 3
 
+#define ROOT_DIR               0    // Inode of the root directory
+
 /*------------ Auxiliar functions ---------------------*/
 
 #define bitmap_getbit(bitmap_, i_) (bitmap_[i_ >> 3] & (1 << (i_ & 0x07)))
@@ -82,3 +207,172 @@ static inline void bitmap_setbit(char *bitmap_, int i_, int val_) {
   else
     bitmap_[(i_ >> 3)] &= ~(1 << (i_ & 0x07));
 }
+
+/* Loads the w_-th 64-bit word of a bitmap of nbytes_ bytes (bit i of the map is bit i%64) */
+static inline uint64_t bitmap_word(const char *bitmap_, int nbytes_, int w_) {
+  uint64_t word = 0;
+  int base = w_ << 3;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (base + 8 <= nbytes_) {
+    memcpy(&word, bitmap_ + base, sizeof(word));
+    return word;
+  }
+#endif
+  for (int k = 0; k < 8 && base + k < nbytes_; k++)
+    word |= (uint64_t)(unsigned char)bitmap_[base + k] << (k << 3);
+  return word;
+}
+
+/* First bit equal to val_ in [from_, to_), or -1 if there is none */
+static inline int bitmap_find(const char *bitmap_, int from_, int to_, int val_) {
+  int nbytes = (to_ + 7) >> 3;
+  for (int w = from_ >> 6; (w << 6) < to_; w++) {
+    uint64_t word = bitmap_word(bitmap_, nbytes, w);
+    if (!val_) word = ~word;
+    if ((w << 6) < from_) word &= ~0ULL << (from_ & 63);
+    if (word) {
+      int i = (w << 6) + __builtin_ctzll(word);
+      return i < to_ ? i : -1;
+    }
+  }
+  return -1;
+}
+
+/* Number of set bits in [0, nbits_) */
+static inline int bitmap_count(const char *bitmap_, int nbits_) {
+  int nbytes = (nbits_ + 7) >> 3, count = 0;
+  for (int w = 0; (w << 6) < nbits_; w++) {
+    uint64_t word = bitmap_word(bitmap_, nbytes, w);
+    if (nbits_ - (w << 6) < 64) word &= (1ULL << (nbits_ - (w << 6))) - 1;
+    count += __builtin_popcountll(word);
+  }
+  return count;
+}
+
+/* Resets the allocator state of a bitmap with nfree_ free entries */
+static inline void bitmap_x_init(bitmap_x_t *map_, int nfree_) {
+  map_->rotor = 0;
+  map_->nfree = nfree_;
+  map_->nreserved = 0;
+}
+
+/* Next-fit allocation: takes the first free bit at or after the rotor, wrapping around */
+static inline int bitmap_alloc(char *bitmap_, int nbits_, bitmap_x_t *map_) {
+  if (map_->nfree <= 0) return -1;
+  int i = bitmap_find(bitmap_, map_->rotor, nbits_, 0);
+  if (i == -1) i = bitmap_find(bitmap_, 0, map_->rotor, 0);
+  if (i == -1) return -1;
+  bitmap_setbit(bitmap_, i, 1);
+  map_->rotor = (i + 1 < nbits_) ? i + 1 : 0;
+  map_->nfree--;
+  return i;
+}
+
+/* Returns an allocated bit to the map */
+static inline void bitmap_release(char *bitmap_, int i_, bitmap_x_t *map_) {
+  bitmap_setbit(bitmap_, i_, 0);
+  map_->nfree++;
+}
+
+/* Name of an inode, either a file or a link */
+static inline char *inode_name(int inode_id_) {
+  return inodes[inode_id_].type == LINK ? inodes[inode_id_].soft_link.link : inodes[inode_id_].inode.name;
+}
+
+/* FNV-1a hash of a name */
+static inline uint32_t fnv_hash(const char *name_) {
+  uint32_t h = 2166136261u;
+  while (*name_) {
+    h ^= (unsigned char)*name_++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Slot of name_hash_x where the search for (dir_, name_) starts */
+static inline int name_hash(int dir_, const char *name_) {
+  return ((fnv_hash(name_) ^ (uint32_t)dir_) * 16777619u) & (NAME_HASH_SIZE - 1);
+}
+
+/* i_-th counter of the name filter for (dir_, name_), by double hashing */
+static inline int bloom_slot(int dir_, const char *name_, int i_) {
+  uint32_t h1 = fnv_hash(name_) ^ ((uint32_t)dir_ * 2654435761u);
+  uint32_t h2 = (h1 >> 17) | (h1 << 15);
+  return (h1 + i_ * (h2 | 1)) & (NAME_BLOOM_SIZE - 1);
+}
+
+static inline int bloom_get(int slot_) {
+  return (superblock.name_bloom[slot_ >> 1] >> ((slot_ & 1) << 2)) & 0x0f;
+}
+
+static inline void bloom_set(int slot_, int val_) {
+  int shift = (slot_ & 1) << 2;
+  superblock.name_bloom[slot_ >> 1] = (superblock.name_bloom[slot_ >> 1] & ~(0x0f << shift)) | (val_ << shift);
+}
+
+/* Counts (dir_, name_) in the name filter once more (delta_ 1) or once less (delta_ -1).
+   Saturated counters are left alone, they can't be decremented safely */
+static inline void bloom_update(int dir_, const char *name_, int delta_) {
+  for (int i = 0; i < NAME_BLOOM_HASHES; i++) {
+    int slot = bloom_slot(dir_, name_, i), val = bloom_get(slot);
+    if (val < 0x0f && val + delta_ >= 0) bloom_set(slot, val + delta_);
+  }
+}
+
+/* FALSE if (dir_, name_) is surely not in the file system */
+static inline int bloom_maybe(int dir_, const char *name_) {
+  for (int i = 0; i < NAME_BLOOM_HASHES; i++) {
+    if (bloom_get(bloom_slot(dir_, name_, i)) == 0) return FALSE;
+  }
+  return TRUE;
+}
+
+/* Direct block of a directory holding the entry for name_ */
+static inline int dir_bucket(const char *name_) {
+  return fnv_hash(name_) % 5;
+}
+
+/* Position inside the segments of an iovec */
+typedef struct {
+  fs_iovec_t *iov;  /* Segments */
+  int seg;          /* Current segment */
+  int off;          /* Bytes of the current segment already copied */
+} iov_cursor_t;
+
+/* Bytes in the segments of an iovec, capped at MAX_FILE_SIZE, or -1 if it is not valid */
+static inline int iov_total(const fs_iovec_t *iov_, int iovcnt_) {
+  int total = 0;
+  if (iovcnt_ < 0 || (iov_ == NULL && iovcnt_ > 0)) return -1;
+  for (int i = 0; i < iovcnt_; i++) {
+    if (iov_[i].len < 0) return -1;
+    total += iov_[i].len < MAX_FILE_SIZE ? iov_[i].len : MAX_FILE_SIZE;
+    if (total > MAX_FILE_SIZE) total = MAX_FILE_SIZE;
+  }
+  return total;
+}
+
+/* Copies n_ bytes between frame_ and the segments at the cursor, moving it forward.
+   to_frame_ TRUE copies from the segments into the frame */
+static inline void iov_copy(iov_cursor_t *cur_, char *frame_, int n_, int to_frame_) {
+  while (n_ > 0) {
+    fs_iovec_t *seg = &cur_->iov[cur_->seg];
+    int len = seg->len - cur_->off;
+    if (len > n_) len = n_;
+    if (to_frame_) memmove(frame_, (char *)seg->base + cur_->off, len);
+    else memmove((char *)seg->base + cur_->off, frame_, len);
+    frame_ += len;
+    n_ -= len;
+    cur_->off += len;
+    if (cur_->off == seg->len) {
+      cur_->seg++;
+      cur_->off = 0;
+    }
+  }
+}
+
+/* Number of data blocks tracked by block_map */
+static inline int data_block_num(void) {
+  int n = (int)superblock.block_num - firstDataBlock;
+  if (n > MAX_BLOCK_NUM) n = MAX_BLOCK_NUM;
+  return n < 0 ? 0 : n;
+}
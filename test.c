@@ -0,0 +1,485 @@
+/*
+ *
+ * Operating System Design / Diseño de Sistemas Operativos
+ * (c) ARCOS.INF.UC3M.ES
+ *
+ * @file 	test.c
+ * @brief 	Regression tests. Needs a disk.dat of 300 blocks (./create_disk 300).
+ *          Build it with -fsanitize=thread to have the data races reported too.
+ * @date	Last revision 01/04/2020
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "filesystem/filesystem.h"
+
+
+#define ANSI_COLOR_RESET "\x1b[0m"
+#define ANSI_COLOR_RED "\x1b[31m"
+#define ANSI_COLOR_BLUE "\x1b[34m"
+#define ANSI_COLOR_GREEN "\x1b[32m"
+
+#define DISK_SIZE (300 * 2048)
+#define TIMEOUT 120 // Seconds: a test that hangs fails
+
+#define ROUNDS 10
+#define CHUNK 512   // 20 chunks fill the largest file
+
+static char pattern[4][CHUNK];
+static atomic_int stop = 0;
+
+
+/* Byte at 'position' of the files written by fill */
+static char byte_at(int position)
+{
+	return 'A' + position % 26;
+}
+
+/* Creates a file and writes 'len' bytes of byte_at into it */
+static int fill(char *path, int len)
+{
+	char data[MAX_FILE_SIZE];
+
+	for (int i = 0; i < len; i++){
+		data[i] = byte_at(i);
+	}
+	if (createFile(path) != 0){ return -1; }
+	int fd = openFile(path);
+	if (fd < 0){ return -1; }
+	int err = (writeFile(fd, data, len) == len) ? 0 : -1;
+	if (closeFile(fd) != 0){ return -1; }
+	return err;
+}
+
+/* Checks that bytes 'from' to 'to' of a file are those of fill, or zeros */
+static int expect(char *path, int from, int to, int zeros)
+{
+	char data[MAX_FILE_SIZE];
+
+	int fd = openFile(path);
+	if (fd < 0){ return -1; }
+	int err = (readFileAt(fd, data, to - from, from) == to - from) ? 0 : -1;
+	for (int i = from; i < to && err == 0; i++){
+		if (data[i - from] != (zeros ? '\0' : byte_at(i))){ err = -1; }
+	}
+	if (closeFile(fd) != 0){ return -1; }
+	return err;
+}
+
+/* Gives the size of a file */
+static int size_of(char *path)
+{
+	char data[MAX_FILE_SIZE];
+
+	int fd = openFile(path);
+	if (fd < 0){ return -1; }
+	int size = readFileAt(fd, data, MAX_FILE_SIZE, 0);
+	if (closeFile(fd) != 0){ return -1; }
+	return size;
+}
+
+/* Gives the data blocks still available */
+static int free_blocks(void)
+{
+	fs_stat_t stat;
+	if (statFS(&stat) != 0){ return -1; }
+	return stat.free_blocks;
+}
+
+/* Creates and removes the names of a test, so that the directory blocks
+   they hash to are already taken when the free blocks are counted */
+static int warm_up(char **names, int count)
+{
+	for (int i = 0; i < count; i++){
+		if (createFile(names[i]) != 0 || removeFile(names[i]) != 0){ return -1; }
+	}
+	return 0;
+}
+
+
+/* Creates, fills and removes a file, and a directory with a link to it */
+static int namespace_round(int round)
+{
+	char name[16], data[3000];
+
+	memset(data, 'n', sizeof(data));
+	sprintf(name, "/n%d", round % 4);
+	if (createFile(name) != 0){ return -1; }
+	int fd = openFile(name);
+	if (fd < 0 || writeFile(fd, data, sizeof(data)) != sizeof(data) || closeFile(fd) != 0){ return -1; }
+	if (mkDir("/d") != 0 || createLn(name, "/d/ln") != 0 || removeLn("/d/ln") != 0 || rmDir("/d") != 0){ return -1; }
+	if (removeFile(name) != 0){ return -1; }
+	return 0;
+}
+
+/* Changes the namespace while the aio workers write */
+static void *namespace_worker(void *arg)
+{
+	int *failed = arg;
+
+	for (int round = 0; !stop; round++){
+		if (namespace_round(round) != 0){
+			*failed = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Asynchronous writes racing with namespace changes */
+static int test_aio_namespace(void)
+{
+	fs_stat_t before, after;
+	fs_aio_event_t events[FS_AIO_DEPTH];
+	char buffer[CHUNK];
+	int failed = 0, namespace_failed = 0;
+	pthread_t thread;
+
+	for (int i = 0; i < 4; i++){
+		memset(pattern[i], 'a' + i, CHUNK);
+	}
+
+	for (int round = 0; round < 4; round++){
+		if (namespace_round(round) != 0){ failed = 1; }
+	}
+	char *names[] = { "/aio" };
+	if (warm_up(names, 1) != 0){ failed = 1; }
+	statFS(&before);
+
+	if (createFile("/aio") != 0){ return -1; }
+	int fd = openFile("/aio");
+	if (fd < 0){ return -1; }
+
+	// Rewrite the whole file with writes in parallel, round after
+	// round, while the other thread changes the namespace
+	stop = 0;
+	pthread_create(&thread, NULL, namespace_worker, &namespace_failed);
+	for (int round = 0; round < ROUNDS; round++){
+		int inflight = 0;
+		for (int i = 0; i < 20; i++){
+			if (aio_writeFile(fd, pattern[round % 4], CHUNK, i * CHUNK, NULL, NULL) == 0){
+				inflight++;
+			} else {
+				failed = 1;
+			}
+		}
+		while (inflight > 0){
+			int n = aio_pollFile(events, FS_AIO_DEPTH, 1);
+			for (int i = 0; i < n; i++){
+				if (events[i].result != CHUNK){ failed = 1; }
+			}
+			inflight -= n;
+		}
+	}
+	stop = 1;
+	pthread_join(thread, NULL);
+	failed |= namespace_failed;
+
+	// The last round of writes covers the whole file
+	char *expected = pattern[(ROUNDS - 1) % 4];
+	for (int i = 0; i < 20 && !failed; i++){
+		if (readFileAt(fd, buffer, CHUNK, i * CHUNK) != CHUNK || memcmp(buffer, expected, CHUNK) != 0){
+			failed = 1;
+		}
+	}
+
+	// unmountFS waits for the writes still running
+	for (int i = 0; i < 20; i++){
+		if (aio_writeFile(fd, pattern[0], CHUNK, i * CHUNK, NULL, NULL) != 0){ failed = 1; }
+	}
+	if (unmountFS() != 0 || mountFS() != 0){ failed = 1; }
+	while (aio_pollFile(events, FS_AIO_DEPTH, 0) > 0){}
+
+	fd = openFile("/aio");
+	for (int i = 0; i < 20 && !failed; i++){
+		if (readFileAt(fd, buffer, CHUNK, i * CHUNK) != CHUNK || memcmp(buffer, pattern[0], CHUNK) != 0){
+			failed = 1;
+		}
+	}
+	closeFile(fd);
+
+	// Nothing was lost nor leaked in the bitmaps
+	if (removeFile("/aio") != 0){ failed = 1; }
+	statFS(&after);
+	if (after.free_blocks != before.free_blocks || after.free_inodes != before.free_inodes){
+		failed = 1;
+	}
+	return failed ? -1 : 0;
+}
+
+
+/* Writing, truncating and punching either copy of a clone */
+static int test_clone_cow(void)
+{
+	char *names[] = { "/src", "/dst" };
+	if (warm_up(names, 2) != 0){ return -1; }
+	int initial = free_blocks();
+
+	// Cloning shares every block
+	if (fill("/src", MAX_FILE_SIZE) != 0){ return -1; }
+	int filled = free_blocks();
+	if (cloneFile("/src", "/dst") != 0 || free_blocks() != filled){ return -1; }
+	if (expect("/dst", 0, MAX_FILE_SIZE, 0) != 0){ return -1; }
+
+	// A write copies only the block it changes, in the copy written
+	int fd = openFile("/dst");
+	if (fd < 0 || writeFileAt(fd, "x", 1, 100) != 1 || closeFile(fd) != 0){ return -1; }
+	if (free_blocks() != filled - 1){ return -1; }
+	if (expect("/src", 0, MAX_FILE_SIZE, 0) != 0){ return -1; }
+	if (expect("/dst", 101, MAX_FILE_SIZE, 0) != 0){ return -1; }
+
+	// Shrinking the source zeroes its partial block without touching the clone
+	fd = openFile("/src");
+	if (fd < 0 || truncateFile(fd, 3000) != 0 || closeFile(fd) != 0){ return -1; }
+	if (size_of("/src") != 3000 || expect("/src", 0, 3000, 0) != 0){ return -1; }
+	if (expect("/dst", 101, MAX_FILE_SIZE, 0) != 0){ return -1; }
+
+	// Punching the clone frees only the blocks no one else owns
+	fd = openFile("/dst");
+	if (fd < 0 || punchHole(fd, 1000, 5000) != 0 || closeFile(fd) != 0){ return -1; }
+	if (expect("/dst", 1000, 6000, 1) != 0 || expect("/dst", 6000, MAX_FILE_SIZE, 0) != 0){ return -1; }
+	if (expect("/src", 0, 3000, 0) != 0){ return -1; }
+
+	// Removing both gives every block back, once
+	if (removeFile("/src") != 0 || removeFile("/dst") != 0){ return -1; }
+	return (free_blocks() == initial) ? 0 : -1;
+}
+
+/* The owners of a shared block are counted across a remount */
+static int test_clone_remount(void)
+{
+	char *names[] = { "/src", "/dst", "/other" };
+	if (warm_up(names, 3) != 0){ return -1; }
+	int initial = free_blocks();
+
+	if (fill("/src", MAX_FILE_SIZE) != 0 || cloneFile("/src", "/dst") != 0){ return -1; }
+	if (unmountFS() != 0 || mountFS() != 0){ return -1; }
+
+	// Removing the source must leave the blocks to the clone, so
+	// a new file can't get them and overwrite its contents
+	if (removeFile("/src") != 0){ return -1; }
+	char data[MAX_FILE_SIZE];
+	memset(data, 'z', sizeof(data));
+	if (createFile("/other") != 0){ return -1; }
+	int fd = openFile("/other");
+	if (fd < 0 || writeFile(fd, data, sizeof(data)) != sizeof(data) || closeFile(fd) != 0){ return -1; }
+	if (unmountFS() != 0 || mountFS() != 0){ return -1; }
+	if (expect("/dst", 0, MAX_FILE_SIZE, 0) != 0){ return -1; }
+
+	if (removeFile("/dst") != 0 || removeFile("/other") != 0){ return -1; }
+	return (free_blocks() == initial) ? 0 : -1;
+}
+
+
+/* Shrinking and growing again leaves zeros past the old end */
+static int test_truncate_grow(void)
+{
+	// Once with the data on disk, once with it still in delayed buffers
+	for (int remount = 1; remount >= 0; remount--){
+		char *path = remount ? "/t" : "/u";
+		if (fill(path, MAX_FILE_SIZE) != 0){ return -1; }
+		if (remount && (unmountFS() != 0 || mountFS() != 0)){ return -1; }
+
+		int fd = openFile(path);
+		if (fd < 0 || truncateFile(fd, 3000) != 0){ return -1; }
+		if (size_of(path) != 3000){ return -1; }
+		if (truncateFile(fd, MAX_FILE_SIZE) != 0 || closeFile(fd) != 0){ return -1; }
+		if (size_of(path) != MAX_FILE_SIZE){ return -1; }
+		if (expect(path, 0, 3000, 0) != 0 || expect(path, 3000, MAX_FILE_SIZE, 1) != 0){ return -1; }
+	}
+	return 0;
+}
+
+/* A punch starting and ending inside blocks frees only the blocks fully inside it */
+static int test_punch_partial(void)
+{
+	if (fill("/p", MAX_FILE_SIZE) != 0){ return -1; }
+	if (unmountFS() != 0 || mountFS() != 0){ return -1; }
+	int before = free_blocks();
+
+	int fd = openFile("/p");
+	if (fd < 0 || punchHole(fd, 1000, 5000) != 0 || closeFile(fd) != 0){ return -1; }
+	if (free_blocks() != before + 1 || size_of("/p") != MAX_FILE_SIZE){ return -1; }
+	if (expect("/p", 0, 1000, 0) != 0 || expect("/p", 1000, 6000, 1) != 0){ return -1; }
+	return expect("/p", 6000, MAX_FILE_SIZE, 0);
+}
+
+/* A punch reaching MAX_FILE_SIZE has no partial block after it */
+static int test_punch_end(void)
+{
+	if (fill("/p", MAX_FILE_SIZE) != 0){ return -1; }
+	if (unmountFS() != 0 || mountFS() != 0){ return -1; }
+	int before = free_blocks();
+
+	int fd = openFile("/p");
+	if (fd < 0 || punchHole(fd, 9000, MAX_FILE_SIZE - 9000) != 0){ return -1; }
+	if (free_blocks() != before || expect("/p", 9000, MAX_FILE_SIZE, 1) != 0){ return -1; }
+	if (punchHole(fd, 4096, MAX_FILE_SIZE - 4096) != 0 || closeFile(fd) != 0){ return -1; }
+	if (free_blocks() != before + 3 || size_of("/p") != MAX_FILE_SIZE){ return -1; }
+	return (expect("/p", 0, 4096, 0) == 0 && expect("/p", 4096, MAX_FILE_SIZE, 1) == 0) ? 0 : -1;
+}
+
+/* Appends to a file until told to stop */
+static void *appender(void *arg)
+{
+	int fd = *(int *)arg;
+	char record[16];
+
+	memset(record, 'r', sizeof(record));
+	while (!stop && writeFile(fd, record, sizeof(record)) >= 0){}
+	return NULL;
+}
+
+/* truncateFile is refused while appends are in flight, and works once they are over */
+static int test_truncate_appends(void)
+{
+	pthread_t threads[4];
+	int refused = 0;
+
+	if (createFile("/a") != 0){ return -1; }
+	int afd = openFileFlags("/a", FS_O_APPEND);
+	int fd = openFile("/a");
+	if (afd < 0 || fd < 0){ return -1; }
+
+	stop = 0;
+	for (int i = 0; i < 4; i++){
+		pthread_create(&threads[i], NULL, appender, &afd);
+	}
+	for (int i = 0; i < 100000 && refused == 0; i++){
+		if (truncateFile(fd, 0) == -1){ refused++; }
+	}
+	stop = 1;
+	for (int i = 0; i < 4; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	if (truncateFile(fd, 0) != 0 || size_of("/a") != 0){ return -1; }
+	if (closeFile(fd) != 0 || closeFile(afd) != 0){ return -1; }
+	return (refused > 0) ? 0 : -1;
+}
+
+
+#define APPENDERS 4
+#define RECORD 32   // Appenders fill the largest file with records of this size
+#define RECORDS (MAX_FILE_SIZE / RECORD / APPENDERS)
+
+/* Appends the records of one thread through its own descriptor */
+static void *record_appender(void *arg)
+{
+	int thread = (int)(long)arg;
+	char record[RECORD + 1];
+
+	int fd = openFileFlags("/log", FS_O_APPEND);
+	for (int seq = 0; seq < RECORDS && fd >= 0; seq++){
+		memset(record, 'a' + thread, RECORD);
+		sprintf(record, "%c%04d", 'a' + thread, seq);
+		record[5] = 'a' + thread;
+		if (writeFile(fd, record, RECORD) != RECORD){ break; }
+	}
+	closeFile(fd);
+	return NULL;
+}
+
+/* Appenders on several threads: every record intact, in order per thread */
+static int test_append_order(void)
+{
+	pthread_t threads[APPENDERS];
+	char data[MAX_FILE_SIZE], expected[RECORD + 1];
+	int next[APPENDERS] = { 0 };
+
+	if (createFile("/log") != 0){ return -1; }
+	for (int i = 0; i < APPENDERS; i++){
+		pthread_create(&threads[i], NULL, record_appender, (void *)(long)i);
+	}
+	for (int i = 0; i < APPENDERS; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	int fd = openFile("/log");
+	if (fd < 0 || readFile(fd, data, MAX_FILE_SIZE) != MAX_FILE_SIZE || closeFile(fd) != 0){ return -1; }
+
+	// Each record is whole, and the records of a thread come in the order it wrote them
+	for (int offset = 0; offset < MAX_FILE_SIZE; offset += RECORD){
+		int thread = data[offset] - 'a';
+		if (thread < 0 || thread >= APPENDERS || next[thread] == RECORDS){ return -1; }
+		memset(expected, 'a' + thread, RECORD);
+		sprintf(expected, "%c%04d", 'a' + thread, next[thread]++);
+		expected[5] = 'a' + thread;
+		if (memcmp(&data[offset], expected, RECORD) != 0){ return -1; }
+	}
+	return 0;
+}
+
+/* Removing a file while appends wait to be published ends them, and
+   the next file on the same inode appends and truncates normally */
+static int test_append_remove(void)
+{
+	pthread_t threads[APPENDERS];
+
+	for (int round = 0; round < 20; round++){
+		if (createFile("/r") != 0){ return -1; }
+		int afd = openFileFlags("/r", FS_O_APPEND);
+		if (afd < 0){ return -1; }
+
+		// The appenders stop when their writes fail, once the file is gone
+		stop = 0;
+		for (int i = 0; i < APPENDERS; i++){
+			pthread_create(&threads[i], NULL, appender, &afd);
+		}
+		usleep(1000);
+		if (removeFile("/r") != 0){ return -1; }
+		for (int i = 0; i < APPENDERS; i++){
+			pthread_join(threads[i], NULL);
+		}
+		if (closeFile(afd) != 0){ return -1; }
+
+		if (createFile("/r") != 0){ return -1; }
+		afd = openFileFlags("/r", FS_O_APPEND);
+		if (afd < 0 || writeFile(afd, "record", 6) != 6 || truncateFile(afd, 0) != 0){ return -1; }
+		if (writeFile(afd, "record", 6) != 6 || size_of("/r") != 6){ return -1; }
+		if (closeFile(afd) != 0 || removeFile("/r") != 0){ return -1; }
+	}
+	return 0;
+}
+
+
+/* Runs a test on a new file system and prints its result */
+static int run_test(char *name, int (*test)(void))
+{
+	int err = -1;
+
+	if (mkFS(DISK_SIZE) == 0 && mountFS() == 0){
+		err = test();
+		if (unmountFS() != 0){ err = -1; }
+	}
+	if (err != 0){
+		fprintf(stdout, "%s%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST ", name, ANSI_COLOR_RED, " FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST ", name, ANSI_COLOR_GREEN, " SUCCESS\n", ANSI_COLOR_RESET);
+	return 0;
+}
+
+
+int main()
+{
+	int failed = 0;
+
+	alarm(TIMEOUT);
+	failed |= run_test("aio with namespace changes", test_aio_namespace);
+	failed |= run_test("clone copy-on-write", test_clone_cow);
+	failed |= run_test("clone across remount", test_clone_remount);
+	failed |= run_test("truncate shrinking and growing", test_truncate_grow);
+	failed |= run_test("punch inside blocks", test_punch_partial);
+	failed |= run_test("punch up to the largest size", test_punch_end);
+	failed |= run_test("truncate with appends in flight", test_truncate_appends);
+	failed |= run_test("appends from several threads", test_append_order);
+	failed |= run_test("remove with appends waiting", test_append_remove);
+
+	return failed ? -1 : 0;
+}